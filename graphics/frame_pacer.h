@@ -0,0 +1,283 @@
+// Frame pacing for the render loop: decides when a frame is sampled and presented
+
+#pragma once
+
+#include <cmath>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+
+#include "../util/cpu_time.tcc"
+
+enum class PacingMode { Vsync, FixedFps, AudioLocked };
+
+inline char const* pacing_mode_name (PacingMode mode) {
+    switch (mode) {
+        case PacingMode::Vsync: return "vsync";
+        case PacingMode::FixedFps: return "fixed";
+        case PacingMode::AudioLocked: return "audio";
+    }
+    return "unknown";
+}
+
+inline PacingMode pacing_mode_from_name (std::string const& name) {
+    for (PacingMode mode : {PacingMode::Vsync, PacingMode::FixedFps, PacingMode::AudioLocked}) {
+        if (name == pacing_mode_name(mode)) {
+            return mode;
+        }
+    }
+    throw std::invalid_argument("Unknown pacing mode \"" + name + "\", expected vsync, fixed or audio");
+}
+
+struct PacerStats {
+    PacingMode mode;
+    double rate_hz;          // Refresh rate (vsync), target rate (fixed) or 0 (audio)
+    size_t frames;
+    double interval_avg_ms;  // Present to present
+    double interval_std_ms;
+    double interval_max_ms;
+    double lead_ms;          // Sample point to predicted present, render cost plus margin
+    double latency_ms;       // Average time from sampling the results to the present
+    size_t late;             // Presents that missed their predicted slot
+    size_t dropped;          // Analysis frames that were never shown
+    size_t duplicated;       // Analysis frames that were shown again
+    double render_cpu;       // Render thread CPU in %, includes waiting by spinning
+    double process_cpu;      // Whole process CPU in %, 100% per saturated core
+};
+
+// Paces the render loop in one of three modes:
+//  - Vsync: swap interval 1, the swap blocks until the display refreshes.
+//  - FixedFps: swap interval 0, frames are presented on a fixed schedule.
+//  - AudioLocked: swap interval 0, the caller renders whenever the primary stream has
+//    a new frame. This was the only behaviour before the pacer existed.
+// For the first two modes the pacer predicts the next present time and the render cost,
+// and wait_for_sample_point() returns just early enough to render before that present.
+// Analysis results sampled right after it are as fresh as possible when they are shown.
+class FramePacer {
+private:
+    typedef std::chrono::steady_clock pacer_clk;
+    static constexpr double spin_margin_us = 200; // Spun on top of the expected sleep overshoot
+    static constexpr double safety_margin_us = 500; // Added to the render cost prediction
+    static constexpr double max_lead_share = 0.9; // Of a period
+    static constexpr double min_rate_hz = 1; // Bounds for target and refresh rates
+    static constexpr double max_rate_hz = 1000;
+
+    PacingMode mode;
+    double target_fps;
+    bool swap_interval_pending = true;
+
+    pacer_clk::time_point last_present;
+    pacer_clk::time_point next_present; // Predicted
+    pacer_clk::time_point vblank; // Estimated time of the last display refresh
+    pacer_clk::time_point sample_point; // Scheduled, the sample itself may come later
+    pacer_clk::time_point sampled_at;
+    bool has_present = false;
+    size_t last_frame_id = 0;
+
+    double vsync_period_us;           // Measured refresh period
+    double render_us = 2000;          // Sample point to swap, mean
+    double render_dev_us = 500;       // and mean absolute deviation
+    double sleep_overshoot_us = 1000; // How late sleep_until wakes up
+
+    // Since the last reset
+    size_t frames, intervals, late, dropped, duplicated;
+    double interval_sum_us, interval_sq_sum_us, interval_max_us, latency_sum_us;
+    pacer_clk::time_point stats_start;
+    double render_cpu_start, process_cpu_start;
+
+    static double elapsed_us (pacer_clk::time_point const& a, pacer_clk::time_point const& b) {
+        std::chrono::duration<double, std::micro> const diff = b - a;
+        return diff.count();
+    }
+
+    static pacer_clk::duration from_us (double us) {
+        return std::chrono::duration_cast<pacer_clk::duration>(std::chrono::duration<double, std::micro>(us));
+    }
+
+    double period_us () const {
+        switch (mode) {
+            case PacingMode::Vsync: return vsync_period_us;
+            case PacingMode::FixedFps: return 1000000.0 / target_fps;
+            case PacingMode::AudioLocked: return 0;
+        }
+        return 0;
+    }
+
+    // Kept below a period, sampling any earlier would mean sampling before the last present
+    double lead_us () const {
+        double const lead = render_us + 2 * render_dev_us + safety_margin_us;
+        return mode == PacingMode::AudioLocked ? lead : std::min(lead, max_lead_share * period_us());
+    }
+
+    // Sleep for the bulk of the wait, then spin with yields for the part the scheduler
+    // can't be trusted with. The sleep overshoot is learned, so the spin stays short.
+    void wait_until (pacer_clk::time_point const& deadline) {
+        pacer_clk::time_point const sleep_target = deadline - from_us(sleep_overshoot_us + spin_margin_us);
+        if (pacer_clk::now() < sleep_target) {
+            std::this_thread::sleep_until(sleep_target);
+            double const overshoot = elapsed_us(sleep_target, pacer_clk::now());
+            // Adapt quickly to longer wakeups, slowly to shorter ones
+            sleep_overshoot_us += (overshoot - sleep_overshoot_us) * (overshoot > sleep_overshoot_us ? 0.5 : 0.05);
+        }
+        while (pacer_clk::now() < deadline) {
+            std::this_thread::yield();
+        }
+    }
+
+public:
+    FramePacer (PacingMode mode, double target_fps, double refresh_hz) :
+        mode(mode), target_fps(clamp_rate(target_fps)),
+        vsync_period_us(1000000.0 / clamp_rate(refresh_hz))
+    {
+        reset_stats();
+    }
+
+    PacingMode get_mode () const {
+        return mode;
+    }
+
+    double get_target_fps () const {
+        return target_fps;
+    }
+
+    // Statistics restart with the new mode, so every mode is reported on its own
+    void set_mode (PacingMode new_mode) {
+        if (new_mode == mode) return;
+        mode = new_mode;
+        swap_interval_pending = true;
+        has_present = false;
+        reset_stats();
+    }
+
+    static double clamp_rate (double hz) {
+        return std::isfinite(hz) ? std::clamp(hz, min_rate_hz, max_rate_hz) : min_rate_hz;
+    }
+
+    // Clamped into [1, 1000] Hz, any rate outside would leave the loop unpaced
+    void set_target_fps (double fps) {
+        fps = clamp_rate(fps);
+        if (fps == target_fps) return;
+        target_fps = fps;
+        has_present = false;
+        reset_stats();
+    }
+
+    // Blocks until the results for the next frame should be sampled. Returns immediately
+    // when audio locked, the caller waits for the stream instead.
+    void wait_for_sample_point () {
+        if (swap_interval_pending) {
+            glfwSwapInterval(mode == PacingMode::Vsync ? 1 : 0);
+            swap_interval_pending = false;
+        }
+        sample_point = pacer_clk::time_point::max();
+        if (mode == PacingMode::AudioLocked || !has_present) {
+            return;
+        }
+
+        // A fixed schedule keeps its phase, vsync follows the refresh grid
+        next_present = (mode == PacingMode::FixedFps ? next_present : vblank) + from_us(period_us());
+        sample_point = next_present - from_us(lead_us());
+        pacer_clk::time_point const now = pacer_clk::now();
+        if (sample_point > now) {
+            wait_until(sample_point);
+        } else if (mode == PacingMode::FixedFps && elapsed_us(next_present, now) > 0) {
+            // Behind schedule, start over from here rather than bursting to catch up
+            next_present = now + from_us(lead_us());
+        }
+    }
+
+    // Call right after sampling the results of analysis frame `frame_id`
+    void frame_sampled (size_t frame_id) {
+        sampled_at = pacer_clk::now();
+        if (last_frame_id != 0) {
+            if (frame_id == last_frame_id) {
+                duplicated++;
+            } else if (frame_id > last_frame_id + 1) {
+                dropped += frame_id - last_frame_id - 1;
+            }
+        }
+        last_frame_id = frame_id;
+    }
+
+    // Swap the buffers and update the predictions
+    void present (GLFWwindow* window) {
+        pacer_clk::time_point const swap_start = pacer_clk::now();
+        glfwSwapBuffers(window);
+        pacer_clk::time_point const now = pacer_clk::now();
+
+        // Waking up late for the sample point counts towards the render cost, so the
+        // lead grows with the scheduling latency on a loaded machine. The frame can't
+        // have started before the last present though, or the lead would feed on itself.
+        pacer_clk::time_point render_start = sampled_at;
+        if (sample_point != pacer_clk::time_point::max()) {
+            render_start = std::min(sampled_at, std::max(sample_point, last_present));
+        }
+        double const render = elapsed_us(render_start, swap_start);
+        render_dev_us += (std::abs(render - render_us) - render_dev_us) / 16;
+        render_us += (render - render_us) / 16;
+        latency_sum_us += elapsed_us(sampled_at, now);
+
+        if (has_present) {
+            double const interval = elapsed_us(last_present, now);
+            double const period = period_us();
+            if (mode == PacingMode::Vsync) {
+                if (interval > 0.5 * period && interval < 1.5 * period) {
+                    vsync_period_us += (interval - vsync_period_us) / 64;
+                }
+                // Swaps return some time after the refresh, never before it. Follow early
+                // returns at once and drift towards late ones slowly, so the grid locks onto
+                // the refresh instead of the wakeup latency.
+                double const refreshes = std::max(std::round(elapsed_us(vblank, now) / vsync_period_us), 1.0);
+                pacer_clk::time_point const expected = vblank + from_us(refreshes * vsync_period_us);
+                double const error = elapsed_us(expected, now);
+                vblank = expected + from_us(error < 0 ? error : error / 32);
+            }
+            if (mode != PacingMode::AudioLocked && elapsed_us(next_present, now) > period / 2) {
+                late++;
+            }
+            interval_sum_us += interval;
+            interval_sq_sum_us += interval * interval;
+            interval_max_us = std::max(interval_max_us, interval);
+            intervals++;
+        }
+        if (!has_present) {
+            next_present = vblank = now;
+        }
+        last_present = now;
+        has_present = true;
+        frames++;
+    }
+
+    void reset_stats () {
+        frames = intervals = late = dropped = duplicated = 0;
+        interval_sum_us = interval_sq_sum_us = interval_max_us = latency_sum_us = 0;
+        stats_start = pacer_clk::now();
+        render_cpu_start = thread_cpu_time_us();
+        process_cpu_start = process_cpu_time_us();
+    }
+
+    // Has to be called from the render thread, its CPU time is reported separately
+    PacerStats stats () const {
+        double const wall_us = std::max(elapsed_us(stats_start, pacer_clk::now()), 1.0);
+        double const n = std::max<size_t>(intervals, 1);
+        double const interval_avg = interval_sum_us / n;
+        double const interval_var = std::max(interval_sq_sum_us / n - interval_avg * interval_avg, 0.0);
+        return PacerStats {
+            .mode = mode,
+            .rate_hz = mode == PacingMode::AudioLocked ? 0 : 1000000.0 / period_us(),
+            .frames = frames,
+            .interval_avg_ms = interval_avg / 1000,
+            .interval_std_ms = std::sqrt(interval_var) / 1000,
+            .interval_max_ms = interval_max_us / 1000,
+            .lead_ms = lead_us() / 1000,
+            .latency_ms = latency_sum_us / std::max<size_t>(frames, 1) / 1000,
+            .late = late,
+            .dropped = dropped,
+            .duplicated = duplicated,
+            .render_cpu = (thread_cpu_time_us() - render_cpu_start) / wall_us * 100,
+            .process_cpu = (process_cpu_time_us() - process_cpu_start) / wall_us * 100
+        };
+    }
+};
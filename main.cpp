@@ -1,4 +1,5 @@
 #include <cstring>
+#include <cerrno>
 #include <cmath>
 #include <complex.h>
 #include <iostream>
@@ -7,6 +8,8 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <deque>
+#include <functional>
 
 // Graphics includes
 #include <glad.h>
@@ -27,13 +30,17 @@
 #include "BTrack.h"
 
 #include "util/fft_handler.h"
-#include "util/ring_buffer.tcc"
+#include "util/jitter_buffer.tcc"
 #include "util/math.tcc"
 #include "util/rolling_window.tcc"
 #include "util/sdl_audio.tcc"
+#include "util/synthetic_audio.tcc"
 #include "visualization/bandpass_standing_wave.tcc"
+#include "visualization/vis_trace.tcc"
+#include "visualization/stream_pipeline.tcc"
 #include "graphics/shader.h"
 #include "graphics/shader_locations.h"
+#include "graphics/frame_pacer.h"
 
 
 // dimensions of application's window
@@ -105,27 +112,21 @@ double time_diff_us (std::chrono::time_point<clk> const& a, std::chrono::time_po
 
 
 template <typename SampleT>
-int sloth_mainloop (uint16_t device_id, SDL_AudioSpec& spec, BTrack& btrack, size_t num_buffers_delay,
-    VisualizationHandler** handlers, size_t const num_handlers, double print_interval_ms, unsigned int const target_fps) {
+int sloth_mainloop (std::vector<StreamPipeline<SampleT>*> const& streams, double print_interval_ms,
+    PacingMode const pacing, double const pacing_fps) {
 
-    using namespace audio;
-
-    printf("Allocating ring buffer of %.3f kB\n", 2 * spec.samples * spec.channels * num_buffers_delay / 1000.0);
-    printf("Audio input delay of %.1f ms\n", num_buffers_delay * spec.samples / (double) spec.freq * 1000.0);
-    RingBuffer<SampleT>* ringBuffer = new RingBuffer<SampleT>(spec.channels * spec.samples, num_buffers_delay);
-    double* mono = new double[spec.samples];
-    math::ExpFilter<double> max_filter(1, 0.90, 0.04, 1);
-
-    auto device_names = get_audio_device_names();
-    std::cout << "Starting audio stream on \"" << device_names[device_id] << "\"" << std::endl;
-    auto stop_audio_stream = start_audio_stream(ringBuffer, spec, device_id);
+    // The primary stream's latest frame is sampled first, the others contribute theirs alongside
+    StreamPipeline<SampleT>* const primary = streams[0];
+    SDL_AudioSpec const& spec = primary->audio_spec;
+    size_t last_frame_id = 0;
+    size_t last_beat_id = 0;
 
     printf("Starting UI\n\n");
     // ui_init();
 
     auto last_frame = clk::now();
     auto last_print = clk::now();
-    double frame_us_nominal = (spec.samples / (double) spec.freq) * 1000000;
+    double const fragment_us = (spec.samples / (double) spec.freq) * 1000000;
     double frame_us_acc = 0;
     size_t frame_counter = 0;
 
@@ -163,7 +164,12 @@ int sloth_mainloop (uint16_t device_id, SDL_AudioSpec& spec, BTrack& btrack, siz
     // we put in relation the window and the callbacks
     glfwSetKeyCallback(window, glfw_key_callback);
     glfwSetFramebufferSizeCallback(window, glfw_framebuffer_size_callback);
-    glfwSwapInterval(0);
+
+    // The pacer sets the swap interval for its mode
+    GLFWvidmode const* video_mode = glfwGetVideoMode(glfwGetPrimaryMonitor());
+    double const refresh_hz = (video_mode != nullptr && video_mode->refreshRate > 0) ? video_mode->refreshRate : 60;
+    FramePacer pacer(pacing, pacing_fps, refresh_hz);
+    printf("Pacing frames in %s mode, display refreshes at %.0f Hz\n", pacing_mode_name(pacing), refresh_hz);
 
 
     //imgui
@@ -187,98 +193,58 @@ int sloth_mainloop (uint16_t device_id, SDL_AudioSpec& spec, BTrack& btrack, siz
     glGenBuffers(1, &ssbo_aux_data);
     glfwMakeContextCurrent(window);
 
+    std::vector<LineParams> params;
+    std::vector<GLfloat> results_concat;
+    std::vector<GLfloat> aux_buffers_concat;
+
     // Rendering loop
     while(!glfwWindowShouldClose(window))
     {
-        try {
-            SampleT* const buf = ringBuffer->dequeue_dirty();
-            last_frame = clk::now();
-
-            for (size_t i = 0; i < spec.samples; i++) {
-                mono[i] = buf[2*i] / ((double) std::pow(2, 16));//(buf[2*i] + buf[2*i + 1]) / ((double) std::pow(2, 17));
-            }
-
-            memset(buf, spec.silence, spec.channels * sizeof(SampleT) * spec.samples);
-            ringBuffer->enqueue_clean(buf);
-        } catch (const timeout_exception& e) {
-            std::cout << "RingBuffer is draining!" << std::endl;
+        // Audio locked frames wait for a new primary frame, the other modes wait for the
+        // pacer's sample point and take whatever is latest. Nothing is drawn before the first frame.
+        pacer.wait_for_sample_point();
+        bool const paced = pacer.get_mode() != PacingMode::AudioLocked && last_frame_id > 0;
+        if (paced ? primary->has_ended() : !primary->await_frame(last_frame_id)) {
+            std::cout << "Primary stream ended" << std::endl;
             break;
         }
-
-        // Maximum filter
-        double maxval = math::max_value(mono, spec.samples);
-        maxval = *max_filter.update(&maxval);
-        maxval = maxval > 2 ? 2 : (maxval < 0.01 ? 0.02 : maxval);
-        for (size_t i = 0; i < spec.samples; i++) {
-            mono[i] /= 2.5 * maxval;
-        }
-
-        btrack.processAudioFrame(mono);
-        bool is_new_beat = btrack.beatDueInCurrentFrame();
-        double tempo_estimate = btrack.getCurrentTempoEstimate();
-
-        VisualizationBuffer const data {
-            .audio_buffer = mono,
-            .tempo_estimate = tempo_estimate,
-            .is_new_beat = is_new_beat
-        };
-
-        for (size_t i = 0; i < num_handlers; i++) {
-            handlers[i]->process_ring_buffer(data);
-        }
-
-
-        LineParams params[num_handlers];
-        for (size_t i = 0; i < num_handlers; i++) {
-            handlers[i]->await_buffer_processed(false); // Keep lock from here
-
-            int result_size = handlers[i]->get_result_size();
-            BPSW_Spec vis_params = ((BandpassStandingWave*)handlers[i])->params;
-            size_t data_end_idx = (i == 0 ? result_size : (params[i-1].data_end_idx + result_size));
-            params[i] = build_line_params(vis_params, result_size, data_end_idx);
-
-            handlers[i]->unlock_mutex(); // Unlock
-        }
-
-        // Shared result buffer for all handler results
-        size_t const total_length = params[num_handlers-1].data_end_idx;
-        GLfloat* results_concat = new GLfloat[total_length];
-        for (size_t i = 0; i < num_handlers; i++) {
-            size_t offset = i == 0 ? 0 : params[i-1].data_end_idx;
-            handlers[i]->await_result(((float*)(results_concat + offset)));
-
-            if (is_new_beat) {
-                auto& queue = ((BandpassStandingWave*) handlers[i])->data_lookback_beats;
-                queue.push_back(
-                    std::vector<float>(
-                        ((float*) results_concat + offset),
-                        ((float*) results_concat + ((size_t) params[i].data_end_idx)))
-                );
-
-                if (queue.size() > 4 && queue.size() > 0) {
-                    queue.pop_front();
+        last_frame = clk::now();
+
+        double tempo_estimate = 0;
+        bool is_new_beat = false;
+        params.clear();
+        results_concat.clear();
+        aux_buffers_concat.clear();
+
+        // Merge the latest frame of every stream, each contributes one LineParams block per handler
+        for (size_t s = 0; s < streams.size(); s++) {
+            std::vector<VisualizationHandler*> const& handlers = streams[s]->get_handlers();
+            streams[s]->with_latest([&] (StreamFrame const& frame) {
+                if (s == 0) {
+                    last_frame_id = frame.frame_id;
+                    pacer.frame_sampled(frame.frame_id);
+                    tempo_estimate = frame.tempo_estimate;
+                    is_new_beat = frame.beat_id != last_beat_id;
+                    last_beat_id = frame.beat_id;
                 }
-            }
-        }
-
 
-        size_t aux_buffer_total_length = 0;
-        for (size_t i = 0; i < num_handlers; i++) {
-            BandpassStandingWave* bpsw = ((BandpassStandingWave*) handlers[i]);
-            params[i].num_aux_lines = bpsw->data_lookback_beats.size();
-            aux_buffer_total_length += params[i].num_aux_lines * params[i].buffer_length;
-        }
-
-        // Prepare data buffer for shader buffer object
-        GLfloat* aux_buffers_concat = new GLfloat[aux_buffer_total_length];
-        size_t total_offset = 0;
-        for (size_t i = 0; i < num_handlers; i++) {
-            auto& queue = ((BandpassStandingWave*) handlers[i])->data_lookback_beats;
-            for (size_t j = 0; j < params[i].num_aux_lines; j++) {
-                size_t max_copy_len = std::min(((size_t)queue[j].size()), ((size_t)params[i].buffer_length));
-                memcpy((aux_buffers_concat + total_offset), queue[j].data(), max_copy_len * sizeof(GLfloat));
-                total_offset += params[i].buffer_length;
-            }
+                size_t offset = 0;
+                for (size_t i = 0; i < frame.result_sizes.size(); i++) {
+                    size_t const result_size = frame.result_sizes[i];
+                    BPSW_Spec const& vis_params = ((BandpassStandingWave*) handlers[i])->params;
+                    results_concat.insert(results_concat.end(),
+                        frame.results.begin() + offset, frame.results.begin() + offset + result_size);
+                    params.push_back(build_line_params(vis_params, result_size, results_concat.size()));
+
+                    params.back().num_aux_lines = frame.lookback_beats[i].size();
+                    for (std::vector<float> const& line : frame.lookback_beats[i]) {
+                        size_t const copy_len = std::min(line.size(), result_size);
+                        aux_buffers_concat.insert(aux_buffers_concat.end(), line.begin(), line.begin() + copy_len);
+                        aux_buffers_concat.resize(aux_buffers_concat.size() + result_size - copy_len, 0);
+                    }
+                    offset += result_size;
+                }
+            });
         }
 
         // we determine the time passed from the beginning
@@ -311,15 +277,15 @@ int sloth_mainloop (uint16_t device_id, SDL_AudioSpec& spec, BTrack& btrack, siz
         glUniform1f(glGetUniformLocation(mainShader.Program, "period_s"), period_s);
         glUniform4f(glGetUniformLocation(mainShader.Program, "color_bg"), color_bg[0], color_bg[1], color_bg[2], color_bg[3]);
         glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo_params);
-        glBufferData(GL_SHADER_STORAGE_BUFFER, num_handlers * sizeof(LineParams), params, GL_STATIC_READ);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, params.size() * sizeof(LineParams), params.data(), GL_STATIC_READ);
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, ssbo_params);
 
         glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo_data);
-        glBufferData(GL_SHADER_STORAGE_BUFFER, total_length * sizeof(GLfloat), results_concat, GL_STATIC_READ);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, results_concat.size() * sizeof(GLfloat), results_concat.data(), GL_STATIC_READ);
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, ssbo_data);
 
         glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo_aux_data);
-        glBufferData(GL_SHADER_STORAGE_BUFFER, aux_buffer_total_length * sizeof(GLfloat), aux_buffers_concat, GL_STATIC_READ);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, aux_buffers_concat.size() * sizeof(GLfloat), aux_buffers_concat.data(), GL_STATIC_READ);
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, ssbo_aux_data);
         glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0); // unbind
 
@@ -335,8 +301,67 @@ int sloth_mainloop (uint16_t device_id, SDL_AudioSpec& spec, BTrack& btrack, siz
         ImGui::SliderFloat("pattern scale", &pattern_scale, 1.0, 20000.0);
         ImGui::SliderFloat("movement scale", &movement_scale, 1.0, 20000.0);
 
+        char const* const pacing_modes[] = {
+            pacing_mode_name(PacingMode::Vsync), pacing_mode_name(PacingMode::FixedFps), pacing_mode_name(PacingMode::AudioLocked)
+        };
+        int pacing_idx = (int) pacer.get_mode();
+        if (ImGui::Combo("pacing", &pacing_idx, pacing_modes, 3)) {
+            pacer.set_mode((PacingMode) pacing_idx);
+        }
+        if (pacer.get_mode() == PacingMode::FixedFps) {
+            int fps = pacer.get_target_fps();
+            if (ImGui::SliderInt("target fps", &fps, 10, 240)) {
+                pacer.set_target_fps(std::clamp(fps, 10, 240)); // Typed in values aren't clamped by ImGui
+            }
+        }
+
         // Ends of imgui
         ImGui::End();
+
+        // Analysis parameters of the primary stream, staged and applied between frames
+        ImGui::Begin("Visualizations");
+        std::vector<VisualizationHandler*> const& primary_handlers = primary->get_handlers();
+        for (size_t i = 0; i < primary_handlers.size(); i++) {
+            BandpassStandingWave* bpsw = (BandpassStandingWave*) primary_handlers[i];
+            BPSW_Spec& vis_params = bpsw->params;
+            ImGui::PushID(i);
+            ImGui::Separator();
+
+            // Edit a copy, ImGui doesn't clamp typed in values. The shared params only
+            // change once the handler accepted them.
+            BPSW_Spec next_params = vis_params;
+            bool changed = false;
+            int win_length = next_params.win_length_samples;
+            int crop_offset = next_params.crop_offset;
+            int crop_length = next_params.crop_length_samples;
+            float dispersion = next_params.fft_dispersion;
+            float phase_const = next_params.fft_phase_const;
+            int const max_win_length = 8 * spec.freq / 10;
+            changed |= ImGui::SliderInt("window samples", &win_length, spec.samples, max_win_length);
+            changed |= ImGui::SliderInt("crop offset", &crop_offset, 0, win_length - 1);
+            changed |= ImGui::SliderInt("crop samples", &crop_length, 1, win_length - crop_offset);
+            changed |= ImGui::SliderFloat("dispersion", &dispersion, -5.0, 5.0);
+            changed |= ImGui::SliderFloat("phase const", &phase_const, -10.0, 10.0);
+            changed |= ImGui::Checkbox("adaptive crop", &next_params.adaptive_crop);
+
+            if (changed) {
+                win_length = std::clamp(win_length, (int) spec.samples, max_win_length);
+                crop_offset = std::clamp(crop_offset, 0, win_length - 1);
+                next_params.win_length_samples = win_length;
+                next_params.crop_offset = crop_offset;
+                next_params.crop_length_samples = std::clamp(crop_length, 1, win_length - crop_offset);
+                next_params.fft_dispersion = dispersion;
+                next_params.fft_phase_const = phase_const;
+                try {
+                    bpsw->reconfigure(next_params);
+                    vis_params = next_params;
+                } catch (std::invalid_argument const& e) {
+                    std::cout << "Ignoring visualization parameters: " << e.what() << std::endl;
+                }
+            }
+            ImGui::PopID();
+        }
+        ImGui::End();
         // Renders the ImGUI elements
         ImGui::Render();
         ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
@@ -345,9 +370,7 @@ int sloth_mainloop (uint16_t device_id, SDL_AudioSpec& spec, BTrack& btrack, siz
         // Check is an I/O event is happening
         glfwPollEvents();
         // Swapping back and front buffers
-        glfwSwapBuffers(window);
-        delete[] results_concat;
-        delete[] aux_buffers_concat;
+        pacer.present(window);
 
         auto now = clk::now();
         frame_counter++;
@@ -356,10 +379,35 @@ int sloth_mainloop (uint16_t device_id, SDL_AudioSpec& spec, BTrack& btrack, siz
             double frame_avg_us = frame_us_acc / frame_counter;
             frame_us_acc = 0;
             last_print = now;
+            // The frame budget is the pacer's period, audio locked frames follow the fragments
+            PacerStats const pacer_stats = pacer.stats();
+            double const budget_us = pacer_stats.rate_hz > 0 ? 1000000.0 / pacer_stats.rate_hz : fragment_us;
             std::cout << "Processed in " << std::setw(10) << frame_avg_us << " us | "
                 << std::setw(8) << std::fixed << std::setprecision(2)
-                << frame_avg_us / frame_us_nominal * 100 << "% for " << target_fps << "FPS | \t"
+                << frame_avg_us / budget_us * 100 << "% of the " << 1000000.0 / budget_us << " FPS frame budget | \t"
                 << "BPM: " << tempo_estimate << std::endl;
+            std::cout << "  [pacer " << pacing_mode_name(pacer_stats.mode);
+            if (pacer_stats.mode != PacingMode::AudioLocked) {
+                std::cout << " @ " << pacer_stats.rate_hz << " Hz";
+            }
+            std::cout << "] " << pacer_stats.frames << " frames | interval " << pacer_stats.interval_avg_ms
+                << " +- " << pacer_stats.interval_std_ms << " ms, max " << pacer_stats.interval_max_ms << " ms"
+                << " | late " << pacer_stats.late << " | dropped " << pacer_stats.dropped
+                << " | duplicated " << pacer_stats.duplicated
+                << " | lead " << pacer_stats.lead_ms << " ms | sample to present " << pacer_stats.latency_ms << " ms"
+                << " | CPU render " << pacer_stats.render_cpu << "% process " << pacer_stats.process_cpu << "%" << std::endl;
+            pacer.reset_stats();
+            for (StreamPipeline<SampleT>* stream : streams) {
+                StreamStats const stream_stats = stream->stats();
+                JitterStats const& jitter = stream_stats.jitter;
+                std::cout << "  [" << stream->name << "] CPU " << stream_stats.cpu_us / stream_stats.wall_us * 100 << "%"
+                    << " | BPM: " << stream_stats.tempo_estimate
+                    << " | depth " << jitter.depth << "/" << jitter.target_depth
+                    << " | +" << jitter.latency_ms << " ms | jitter " << jitter.arrival_jitter_us << " us"
+                    << " | service " << jitter.service_us << " us"
+                    << " | overruns " << jitter.overruns << " | underruns " << jitter.underruns
+                    << " | skipped " << jitter.skipped << " | repeated " << jitter.repeated << std::endl;
+            }
             frame_counter = 0;
         }
     }
@@ -377,35 +425,159 @@ int sloth_mainloop (uint16_t device_id, SDL_AudioSpec& spec, BTrack& btrack, siz
     // we close and delete the created context
     glfwTerminate();
 
+    return 0;
+}
 
-    printf("\n\nStopping visualization threads\n");
-    for (size_t i = 0; i < num_handlers; i++) {
-        handlers[i]->stop_thread();
-    }
+// Runs 1..max_streams synthetic streams headless and reports how the CPU cost
+// of a stream (pipeline and handler threads) and of the process scales.
+template <typename SampleT>
+int sloth_stream_benchmark (std::function<StreamPipeline<SampleT>*(std::string const&)> const& make_stream,
+    size_t const max_streams, double const seconds) {
+
+    std::cout << "Benchmarking up to " << max_streams << " synthetic streams for " << seconds << " s each on "
+        << SDL_GetCPUCount() << " cores" << std::endl;
 
-    printf("\n\nStopping audio stream and deconstructing.\n");
-    ringBuffer->drain();
-    stop_audio_stream();
+    double single_stream_frame_us = 0;
+    for (size_t n = 1; n <= max_streams; n++) {
+        std::vector<StreamPipeline<SampleT>*> streams;
+        for (size_t s = 0; s < n; s++) {
+            streams.push_back(make_stream("synth" + std::to_string(s)));
+        }
 
-    delete ringBuffer;
-    delete[] mono;
+        double const process_cpu_start = process_cpu_time_us();
+        auto const start = clk::now();
+        for (size_t s = 0; s < n; s++) {
+            streams[s]->start_synthetic(120 + 4 * s, s + 1);
+        }
+        SDL_Delay(seconds * 1000);
+
+        double const wall_us = time_diff_us(start, clk::now());
+        double const process_cpu = (process_cpu_time_us() - process_cpu_start) / wall_us * 100;
+        double streams_cpu = 0;
+        double frame_us = 0;
+        std::cout << std::fixed << std::setprecision(2);
+        for (StreamPipeline<SampleT>* stream : streams) {
+            StreamStats const stats = stream->stats();
+            double const stream_cpu = stats.cpu_us / stats.wall_us * 100;
+            double const stream_frame_us = stats.cpu_us / std::max<size_t>(stats.frames, 1);
+            streams_cpu += stream_cpu;
+            frame_us += stream_frame_us / n;
+            std::cout << "  [" << stream->name << "] " << stats.frames << " frames | CPU " << stream_cpu << "%"
+                << " | " << stream_frame_us << " us per frame"
+                << " | underruns " << stats.jitter.underruns << " | overruns " << stats.jitter.overruns << std::endl;
+        }
+        if (n == 1) {
+            single_stream_frame_us = frame_us;
+        }
+        // Linear scaling keeps the per frame cost of a stream constant, the total grows with n
+        // until the cores are saturated and streams start dropping frames.
+        std::cout << n << " streams | streams CPU " << streams_cpu << "% | process CPU " << process_cpu << "%"
+            << " | per frame cost " << frame_us / single_stream_frame_us << "x of a single stream" << std::endl;
 
+        for (StreamPipeline<SampleT>* stream : streams) {
+            delete stream;
+        }
+    }
     return 0;
 }
 
+// Command line counts, whole numbers of at least 1
+size_t parse_count (std::string const& flag, std::string const& text) {
+    char* end = nullptr;
+    errno = 0;
+    unsigned long long const value = strtoull(text.c_str(), &end, 10);
+    if (text.empty() || !isdigit((unsigned char) text[0]) || *end != '\0' || errno == ERANGE || value < 1) {
+        throw std::invalid_argument(flag + " expects a whole number of at least 1, got \"" + text + "\"");
+    }
+    return value;
+}
+
+// Command line rates in Hz, positive and finite
+double parse_rate (std::string const& flag, std::string const& text) {
+    char* end = nullptr;
+    double const value = strtod(text.c_str(), &end);
+    if (text.empty() || *end != '\0' || !std::isfinite(value) || value < 1) {
+        throw std::invalid_argument(flag + " expects a rate of at least 1, got \"" + text + "\"");
+    }
+    return value;
+}
+
 int main (int argc, char** argv) {
     std::cout << "Starting sloth3 realtime audio visualizer..." << std::endl;
 
     using namespace audio;
     sdl_init();
 
-    uint16_t device_id = 0;
-    if (argc > 1) {
-	   device_id = atoi(argv[1]);
-    } else {
+    std::vector<std::string> sources;
+    size_t bench_streams = 0;
+    double bench_seconds = 10;
+    std::string record_path, replay_path, golden_path, compare_path;
+    bool replay_throttled = true;
+    bool replay_headless = false;
+    PacingMode pacing = PacingMode::Vsync;
+    double pacing_fps = 60;
+    size_t min_buffers_delay = 1; // Jitter buffer depth bounds in fragments, adapted at runtime in between
+    size_t max_buffers_delay = 20;
+    for (int i = 1; i < argc; i++) {
+        std::string const arg = argv[i];
+        bool const has_value = i + 1 < argc;
+        if (arg == "--record" && has_value) {
+            record_path = argv[++i];
+        } else if (arg == "--replay" && has_value) {
+            replay_path = argv[++i];
+        } else if (arg == "--golden" && has_value) {
+            golden_path = argv[++i];
+        } else if (arg == "--compare" && has_value) {
+            compare_path = argv[++i];
+        } else if (arg == "--unthrottled") {
+            replay_throttled = false;
+        } else if (arg == "--headless") {
+            replay_headless = true;
+        } else if (arg == "--pacing" && has_value) {
+            try {
+                pacing = pacing_mode_from_name(argv[++i]);
+            } catch (std::invalid_argument const& e) {
+                std::cout << e.what() << std::endl;
+                return 1;
+            }
+        } else if (arg == "--fps" && has_value) {
+            try {
+                pacing_fps = parse_rate(arg, argv[++i]);
+            } catch (std::invalid_argument const& e) {
+                std::cout << e.what() << std::endl;
+                return 1;
+            }
+        } else if ((arg == "--min-delay" || arg == "--max-delay") && has_value) {
+            try {
+                (arg == "--min-delay" ? min_buffers_delay : max_buffers_delay) = parse_count(arg, argv[++i]);
+            } catch (std::invalid_argument const& e) {
+                std::cout << e.what() << std::endl;
+                return 1;
+            }
+        } else if (arg == "--bench" && has_value) {
+            bench_streams = atoi(argv[++i]);
+        } else if (arg == "--bench-seconds" && has_value) {
+            bench_seconds = atof(argv[++i]);
+        } else {
+            sources.push_back(arg);
+        }
+    }
+    if (min_buffers_delay > max_buffers_delay) {
+        std::cout << "--min-delay " << min_buffers_delay << " is above --max-delay " << max_buffers_delay << std::endl;
+        return 1;
+    }
+    // Writing or comparing handler results only makes sense without a window
+    replay_headless |= !golden_path.empty() || !compare_path.empty();
+
+    if (sources.empty() && replay_path.empty() && bench_streams == 0) {
         auto device_names = get_audio_device_names();
         std::cout << "\nNo audio device specified. Please choose one!" << std::endl;
-        std::cout << "Usage: \"./sloth3 <device_id>\"\n" << std::endl;
+        std::cout << "Usage: \"./sloth3 <device_id|synth> [<device_id|synth> ...] [--record <trace>] [--pacing vsync|fixed|audio] [--fps <n>]" << std::endl;
+        std::cout << "                 [--min-delay <fragments>] [--max-delay <fragments>]\"" << std::endl;
+        std::cout << "       \"./sloth3 --replay <trace> [--unthrottled] [--headless] [--golden <trace>] [--compare <trace>]\"" << std::endl;
+        std::cout << "       \"./sloth3 --bench <max_streams> [--bench-seconds <s>]\"\n" << std::endl;
+        std::cout << "Every device (or synthetic source) is captured as its own stream, the first one paces the renderer" << std::endl;
+        std::cout << "with \"--pacing audio\". Frames follow the display refresh by default, \"--pacing fixed\" renders at --fps." << std::endl;
         std::cout << "Available devices:" << std::endl;
         for (size_t i = 0; i < device_names.size(); i++) {
             std::cout << "\t" << i << ": " << device_names[i] << std::endl;
@@ -414,6 +586,16 @@ int main (int argc, char** argv) {
         return 1;
     }
 
+    trace::TraceReader* replay = nullptr;
+    if (!replay_path.empty()) {
+        try {
+            replay = new trace::TraceReader(replay_path);
+        } catch (std::runtime_error const& e) {
+            std::cout << e.what() << std::endl;
+            return 1;
+        }
+    }
+
     std::cout << std::endl << std::endl;
 
     /* -------------------- CONFIGURATION --------------------------------- */
@@ -426,14 +608,28 @@ int main (int argc, char** argv) {
     spec.freq = 48000;
     spec.channels = 2;
 
-    const static unsigned int target_fps = 60;
-    const static double update_interval_ms = 1000.0 / ((double) target_fps);
+    const static unsigned int analysis_fps = 60; // Analysis updates per second, the render rate is up to the pacer
+    const static double update_interval_ms = 1000.0 / ((double) analysis_fps);
     const static double window_length_ms = 100;
     const static double print_interval_ms = 2000;
-    const static int num_buffers_delay = 1;//20;
+
+    // A replay has to run with the audio format it was recorded with
+    if (replay != nullptr) {
+        spec.freq = replay->sample_rate();
+    }
 
     size_t window_length_samples = window_length_ms / 1000 * spec.freq;
     spec.samples = (size_t) update_interval_ms / 1000.0 * spec.freq;
+    if (replay != nullptr) {
+        spec.samples = replay->update_length_samples();
+        try {
+            replay->require_frame_length(spec.samples);
+        } catch (std::runtime_error const& e) {
+            std::cout << e.what() << std::endl;
+            delete replay;
+            return 1;
+        }
+    }
 
     BPSW_Spec params {
         .win_length_samples = window_length_samples,
@@ -449,13 +645,10 @@ int main (int argc, char** argv) {
         .c_rad_extr = 0.6,
         .color_inner = {0.03529411764705882, 0.20392156862745098, 0.48627450980392156, 1.0}
     };
-    size_t c_length = params.win_length_samples / 2 + 1;
-    double* freq_weighing = new double[c_length];
-    for (size_t i = 0; i < c_length; i++) {
-        freq_weighing[i] = i < 10 ? 1.5 :
-                           i < 40 ? 1 : 0.05;
-    }
-    params.fft_freq_weighing = freq_weighing;
+    params.fft_freq_weighing = [] (size_t i, size_t /*c_length*/) {
+        return i < 10 ? 1.5 :
+               i < 40 ? 1 : 0.05;
+    };
 
 
     BPSW_Spec params_inner {
@@ -472,33 +665,108 @@ int main (int argc, char** argv) {
         .c_rad_extr = 1.8,
         .color_inner = {0.9803921568627451, 0.6509803921568628, 0.07450980392156863, 1.0}
     };
-    size_t c_length_i = params_inner.win_length_samples / 2 + 1;
-    double* freq_weighing_inner = new double[c_length_i];
-    for (size_t i = 0; i < c_length_i; i++) {
-        freq_weighing_inner[i] = i < 200 ? 0 : ( i > (c_length_i - 1200) ? 0 : 1);
-    }
-    params_inner.fft_freq_weighing = freq_weighing_inner;
+    params_inner.fft_freq_weighing = [] (size_t i, size_t c_length) {
+        return i < 200 ? 0 : ( i + 1200 > c_length ? 0 : 1);
+    };
 
 
     /* -------------------- CONFIGURATION END ----------------------------- */
 
-    printf("Instantiating visualizations\n");
-    BandpassStandingWave bpsw {spec, params};
-    BandpassStandingWave bpsw_inner {spec, params_inner};
-    printf("Done\n");
+    // Every stream gets its own handlers and parameter copies, adaptive_crop writes to them
+    std::deque<BPSW_Spec> stream_params;
+    std::function<StreamPipeline<SampleT>*(std::string const&)> make_stream = [&] (std::string const& name) {
+        printf("Instantiating visualizations for stream \"%s\"\n", name.c_str());
+        auto* stream = new StreamPipeline<SampleT>(name, spec, min_buffers_delay, max_buffers_delay);
+        for (BPSW_Spec const& handler_params : {params, params_inner}) {
+            stream_params.push_back(handler_params);
+            stream->add_handler(new BandpassStandingWave(stream->audio_spec, stream_params.back()));
+        }
+        printf("Done\n");
+        return stream;
+    };
 
-    constexpr size_t num_handlers = 2;
-    printf("Instantiating visualization handler\n");
-    VisualizationHandler* handlers[num_handlers] = {&bpsw, &bpsw_inner/*, &bpsw2*/};
-    printf("Done\n");
+    int retval = 0;
+    if (bench_streams > 0) {
+        retval = sloth_stream_benchmark<SampleT>(make_stream, bench_streams, bench_seconds);
+    } else if (replay != nullptr && replay_headless) {
+        StreamPipeline<SampleT>* stream = make_stream("replay");
+        std::vector<VisualizationHandler*> const& handlers = stream->get_handlers();
+
+        trace::TraceWriter* golden = nullptr;
+        if (!golden_path.empty()) {
+            size_t slot_length = 0;
+            for (VisualizationHandler* handler : handlers) {
+                slot_length += ((BandpassStandingWave*) handler)->params.win_length_samples;
+            }
+            golden = new trace::TraceWriter(golden_path, spec, slot_length, true);
+        }
 
-    std::cout << "Initializing BTrack with " << spec.samples << " samples" << std::endl;
-    BTrack btrack(spec.freq, spec.samples / 2, spec.samples);
+        trace::ReplayStats const stats = trace::replay(*replay, handlers.data(), handlers.size(), replay_throttled, golden);
+        std::cout << "Replayed " << stats.frames << " frames in " << stats.wall_us / 1000 << " ms | "
+            << "avg " << stats.frame_us_avg << " us | max " << stats.frame_us_max << " us per frame" << std::endl;
+        delete golden;
+        delete stream;
+
+        if (!compare_path.empty()) {
+            if (golden_path.empty()) {
+                std::cout << "--compare needs the results written with --golden" << std::endl;
+                retval = 1;
+            } else {
+                try {
+                    trace::TraceReader const reference(compare_path);
+                    trace::TraceReader const results(golden_path);
+                    trace::CompareStats const diff = trace::compare(reference, results);
+                    std::cout << "Compared " << diff.frames_compared << " frames against \"" << compare_path << "\": "
+                        << diff.frames_differing << " differ, max abs diff " << diff.max_abs_diff << std::endl;
+                    retval = diff.frames_differing == 0 ? 0 : 2;
+                } catch (std::runtime_error const& e) {
+                    std::cout << e.what() << std::endl;
+                    retval = 1;
+                }
+            }
+        }
+    } else {
+        trace::TraceWriter* recorder = nullptr;
+        if (!record_path.empty()) {
+            std::cout << "Recording visualization buffers of the primary stream to \"" << record_path << "\"" << std::endl;
+            recorder = new trace::TraceWriter(record_path, spec, spec.samples);
+        }
+
+        // A replay takes the place of the primary stream, further sources are captured alongside
+        std::vector<StreamPipeline<SampleT>*> streams;
+        if (replay != nullptr) {
+            streams.push_back(make_stream("replay"));
+        }
+        for (size_t i = 0; i < sources.size(); i++) {
+            streams.push_back(make_stream(std::to_string(streams.size()) + ":" + sources[i]));
+        }
+
+        // The recorder has to be in place before the primary stream starts
+        streams[0]->set_recorder(recorder);
+        size_t const first_source = replay != nullptr ? 1 : 0;
+        if (replay != nullptr) {
+            streams[0]->start_replay(replay, replay_throttled);
+        }
+        for (size_t i = 0; i < sources.size(); i++) {
+            StreamPipeline<SampleT>* stream = streams[first_source + i];
+            if (sources[i] == "synth") {
+                stream->start_synthetic(124, i + 1);
+            } else {
+                stream->start_device(atoi(sources[i].c_str()));
+            }
+        }
+
+        retval = sloth_mainloop<SampleT>(streams, print_interval_ms, pacing, pacing_fps);
+        std::cout << "Mainloop ended" << std::endl;
+
+        printf("\n\nStopping streams and deconstructing.\n");
+        for (StreamPipeline<SampleT>* stream : streams) {
+            delete stream;
+        }
+        delete recorder;
+    }
 
-    int retval = sloth_mainloop<SampleT>(device_id, spec, btrack, num_buffers_delay, handlers, num_handlers, print_interval_ms, target_fps);
-    std::cout << "Mainloop ended" << std::endl;
-    delete[] freq_weighing;
-    delete[] freq_weighing_inner;
+    delete replay;
     return retval;
 }
 
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <time.h>
+
+// CPU time consumed by the calling thread, excludes time spent blocked
+inline double thread_cpu_time_us () {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+// CPU time consumed by the whole process, all threads
+inline double process_cpu_time_us () {
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
@@ -0,0 +1,340 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <SDL2/SDL.h>
+
+#include "timeout_exception.h"
+
+struct JitterStats {
+    size_t overruns; // Producer found no free buffer, two queued fragments were merged
+    size_t underruns; // Consumer found the queue empty, the last fragment was repeated faded
+    size_t skipped; // Fragments merged to shrink the queue
+    size_t repeated; // Fragments inserted to grow the queue
+    size_t depth; // Fragments currently queued
+    size_t target_depth;
+    double arrival_jitter_us; // Recent peak lateness against the arrival grid
+    double service_us;
+    double latency_ms; // Added latency, averaged queue depth after each dequeue
+};
+
+// An adaptive jitter buffer between the audio callback and the render loop.
+// The producer never blocks. The consumer waits for the queue to fill up to the
+// target depth when starting and after an underrun, after that fragments are played
+// out once per period, so bursts of arrivals are absorbed by the queue. Depth is steered between [min_depth, max_depth] from the lateness of
+// arrivals and the service time of the consumer. The queue is grown or shrunk by
+// crossfading fragments instead of dropping them.
+template <typename T>
+class JitterBuffer {
+private:
+    typedef std::chrono::steady_clock jb_clk;
+
+    // EWMA gain, same as the RFC 3550 interarrival jitter estimate
+    static constexpr double filter_gain = 1.0 / 16;
+    // Time the desired depth (or the queue's low water mark) has to stay above
+    // target before shrinking
+    static constexpr double shrink_hold_us = 2000000;
+    // Gain with which the arrival grid follows fragments arriving consistently late
+    static constexpr double grid_drift_gain = 1.0 / 256;
+
+    SDL_mutex* jb_mutex;
+    SDL_cond* jb_cond;
+
+    std::vector<T*> buffers;
+    std::vector<T*> clean;
+    std::deque<T*> dirty;
+    T* last_output;
+
+    size_t const channels;
+    size_t const min_depth, max_depth;
+    double const period_us;
+    size_t target_depth;
+    size_t pending_growth = 0; // Fragments still to be inserted after the target grew
+    size_t pending_shrink = 0; // Fragments still to be merged away after a persistent excess
+    bool priming = true; // Waiting for the queue to reach the target depth
+    bool draining = false;
+
+    jb_clk::time_point last_arrival;
+    jb_clk::time_point arrival_grid; // Expected arrival time of the last fragment
+    jb_clk::time_point last_dequeue;
+    jb_clk::time_point next_playout;
+    jb_clk::time_point shrink_since;
+    jb_clk::time_point low_water_since;
+    size_t low_water; // Lowest queue depth seen at a playout since low_water_since
+    bool has_arrival = false;
+    bool has_dequeue = false;
+    bool shrink_pending = false;
+    size_t consecutive_underruns = 0;
+
+    double arrival_jitter_us = 0;
+    double service_us = 0;
+    double service_dev_us = 0;
+    double depth_avg = 0;
+    size_t overruns = 0, underruns = 0, skipped = 0, repeated = 0;
+
+    static double elapsed_us (jb_clk::time_point const& a, jb_clk::time_point const& b) {
+        std::chrono::duration<double, std::micro> const diff = b - a;
+        return diff.count();
+    }
+
+    // out = a faded into b over the length of the fragment, gain applied to b
+    void crossfade (T* out, T const* a, T const* b, double gain_b = 1.0) const {
+        size_t const frames = buffer_len / channels;
+        for (size_t i = 0; i < frames; i++) {
+            double const w = (i + 1) / (double) frames;
+            for (size_t c = 0; c < channels; c++) {
+                size_t const idx = i * channels + c;
+                out[idx] = (T) ((1.0 - w) * a[idx] + w * gain_b * b[idx]);
+            }
+        }
+    }
+
+    void update_target (jb_clk::time_point const& now) {
+        // Fragments can be late by up to arrival_jitter_us, the consumer needs that much queued
+        double const headroom_us = arrival_jitter_us + 3 * service_dev_us;
+        size_t desired = min_depth + (size_t) std::ceil(headroom_us / period_us - 0.1);
+        desired = std::clamp(desired, min_depth, max_depth);
+
+        if (desired > target_depth) {
+            pending_growth += desired - target_depth;
+            target_depth = desired;
+            shrink_pending = false;
+        } else if (desired < target_depth) {
+            // Only shrink once the lower depth has been sufficient for a while
+            if (!shrink_pending) {
+                shrink_pending = true;
+                shrink_since = now;
+            } else if (elapsed_us(shrink_since, now) > shrink_hold_us) {
+                target_depth--;
+                shrink_since = now;
+            }
+        } else {
+            shrink_pending = false;
+        }
+    }
+
+    T* take_clean () {
+        T* buf = clean.back();
+        clean.pop_back();
+        return buf;
+    }
+
+public:
+    size_t const buffer_len;
+
+    JitterBuffer (size_t buffer_len, size_t channels, double period_us, size_t min_depth, size_t max_depth) :
+        jb_mutex(SDL_CreateMutex()), jb_cond(SDL_CreateCond()),
+        channels(channels), min_depth(std::max<size_t>(min_depth, 1)), max_depth(std::max(this->min_depth, max_depth)),
+        period_us(period_us), target_depth(this->min_depth), low_water(SIZE_MAX), buffer_len(buffer_len)
+    {
+        // Queue up to max_depth, one handed out to the consumer and one spare for repeats
+        for (size_t i = 0; i < this->max_depth + 2; i++) {
+            buffers.push_back(new T[buffer_len]());
+        }
+        clean = buffers;
+        last_output = new T[buffer_len]();
+        low_water_since = jb_clk::now();
+    }
+
+    ~JitterBuffer () {
+        drain();
+        SDL_DestroyCond(jb_cond);
+        SDL_DestroyMutex(jb_mutex);
+        for (T* buf : buffers) {
+            delete[] buf;
+        }
+        delete[] last_output;
+    }
+
+    void drain () {
+        SDL_LockMutex(jb_mutex);
+        draining = true;
+        SDL_CondBroadcast(jb_cond);
+        SDL_UnlockMutex(jb_mutex);
+    }
+
+    // Called from the audio callback, never blocks on the consumer.
+    void write (T const* data, size_t len) {
+        auto const now = jb_clk::now();
+        SDL_LockMutex(jb_mutex);
+        if (draining) {
+            SDL_UnlockMutex(jb_mutex);
+            return;
+        }
+
+        // Arrivals are compared against a grid locked onto the earliest fragments, so a burst
+        // of n fragments shows up as the first ones having been late, not as jitter on every
+        // interval. The peak lateness decays slowly, bursts keep it up.
+        if (has_arrival) {
+            jb_clk::time_point const expected = arrival_grid + std::chrono::duration_cast<jb_clk::duration>(
+                std::chrono::duration<double, std::micro>(period_us));
+            double const lateness = elapsed_us(expected, now);
+            if (lateness <= 0) {
+                arrival_grid = now;
+            } else {
+                arrival_grid = expected + std::chrono::duration_cast<jb_clk::duration>(
+                    std::chrono::duration<double, std::micro>(lateness * grid_drift_gain));
+            }
+            arrival_jitter_us = std::max(std::max(lateness, 0.0), arrival_jitter_us * (1 - filter_gain));
+        } else {
+            arrival_grid = now;
+        }
+        last_arrival = now;
+        has_arrival = true;
+
+        if (clean.empty() && dirty.size() < 2) {
+            // Nothing to merge, the consumer is holding on to the remaining buffers
+            overruns++;
+            SDL_UnlockMutex(jb_mutex);
+            return;
+        } else if (clean.empty()) {
+            // Overrun: merge the two oldest fragments to make room
+            T* a = dirty.front();
+            dirty.pop_front();
+            T* b = dirty.front();
+            dirty.pop_front();
+            crossfade(a, a, b);
+            dirty.push_front(a);
+            clean.push_back(b);
+            overruns++;
+        }
+
+        T* buf = take_clean();
+        std::memcpy(buf, data, std::min(len, buffer_len) * sizeof(T));
+        dirty.push_back(buf);
+
+        SDL_CondSignal(jb_cond);
+        SDL_UnlockMutex(jb_mutex);
+    }
+
+    // Get the next fragment. Waits for the next playout time, or while priming until
+    // the target depth is reached. If no fragment is queued at the playout time a
+    // crossfaded repeat is returned instead.
+    T* dequeue_dirty () {
+        auto now = jb_clk::now();
+        SDL_LockMutex(jb_mutex);
+
+        if (has_dequeue) {
+            double const service = elapsed_us(last_dequeue, now);
+            service_dev_us += (std::abs(service - service_us) - service_dev_us) * filter_gain;
+            service_us += (service - service_us) * filter_gain;
+        }
+
+        jb_clk::duration const period = std::chrono::duration_cast<jb_clk::duration>(
+            std::chrono::duration<double, std::micro>(period_us));
+        bool behind = false;
+        if (priming) {
+            while (!draining && dirty.size() < target_depth) {
+                SDL_CondWait(jb_cond, jb_mutex);
+            }
+            next_playout = jb_clk::now();
+            priming = false;
+        } else {
+            // Play out one fragment per period whatever the arrival pattern. A consumer
+            // that fell behind carries on from now instead of catching up in a burst.
+            next_playout += period;
+            behind = jb_clk::now() - next_playout > period / 2;
+            if (jb_clk::now() - next_playout > period) {
+                next_playout = jb_clk::now();
+            }
+            while (!draining && (now = jb_clk::now()) < next_playout) {
+                double const wait_us = elapsed_us(now, next_playout);
+                SDL_CondWaitTimeout(jb_cond, jb_mutex, (Uint32) std::ceil(wait_us / 1000));
+            }
+        }
+
+        if (draining) {
+            SDL_UnlockMutex(jb_mutex);
+            throw timeout_exception("JitterBuffer is draining");
+        }
+
+        now = jb_clk::now();
+        update_target(now);
+
+        // The target depth is there to ride out late fragments, so at the worst moment
+        // only min_depth should be left. If more stayed queued for the whole hold time
+        // the queue is deeper than needed, momentary overshoots from bursts don't count.
+        // A consumer that can't keep up with the playout clock sheds any excess at once.
+        low_water = std::min(low_water, dirty.size());
+        if (elapsed_us(low_water_since, now) > shrink_hold_us) {
+            pending_shrink = low_water > min_depth ? low_water - min_depth : 0;
+            low_water = SIZE_MAX;
+            low_water_since = now;
+        }
+        bool const shrink = (pending_shrink > 0 || (behind && dirty.size() > target_depth)) && dirty.size() >= 2;
+
+        T* out;
+        if (dirty.empty()) {
+            // Underrun: repeat the last fragment, fading out further on every consecutive miss,
+            // and fill up to the (raised) target again
+            consecutive_underruns++;
+            out = take_clean();
+            crossfade(out, last_output, last_output, std::pow(0.5, consecutive_underruns));
+            underruns++;
+            target_depth = std::min(target_depth + 1, max_depth);
+            pending_growth = 0;
+            pending_shrink = 0;
+            priming = true;
+            shrink_pending = false;
+        } else if (pending_growth > 0 && !clean.empty()) {
+            // Growing: insert a fragment bridging the last output and the next one
+            consecutive_underruns = 0;
+            pending_growth--;
+            out = take_clean();
+            crossfade(out, last_output, dirty.front());
+            repeated++;
+        } else if (shrink) {
+            // Shrinking: merge the two oldest fragments into one
+            consecutive_underruns = 0;
+            pending_shrink -= pending_shrink > 0 ? 1 : 0;
+            out = dirty.front();
+            dirty.pop_front();
+            T* next = dirty.front();
+            dirty.pop_front();
+            crossfade(out, out, next);
+            clean.push_back(next);
+            skipped++;
+        } else {
+            consecutive_underruns = 0;
+            out = dirty.front();
+            dirty.pop_front();
+        }
+
+        std::memcpy(last_output, out, buffer_len * sizeof(T));
+        depth_avg += (dirty.size() - depth_avg) * filter_gain;
+        last_dequeue = jb_clk::now();
+        has_dequeue = true;
+
+        SDL_UnlockMutex(jb_mutex);
+        return out;
+    }
+
+    void enqueue_clean (T* buf) {
+        SDL_LockMutex(jb_mutex);
+        clean.push_back(buf);
+        SDL_UnlockMutex(jb_mutex);
+    }
+
+    JitterStats stats () {
+        SDL_LockMutex(jb_mutex);
+        JitterStats const s {
+            .overruns = overruns,
+            .underruns = underruns,
+            .skipped = skipped,
+            .repeated = repeated,
+            .depth = dirty.size(),
+            .target_depth = target_depth,
+            .arrival_jitter_us = arrival_jitter_us,
+            .service_us = service_us,
+            .latency_ms = depth_avg * period_us / 1000
+        };
+        SDL_UnlockMutex(jb_mutex);
+        return s;
+    }
+};
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_thread.h>
+
+// A single background thread running jobs in submission order.
+// The FFTW planner is not thread-safe, so everything creating or destroying
+// plans goes through this worker: the BandpassStandingWave states and the
+// BTrack of every StreamPipeline. It also keeps that work off the analysis
+// threads. Anything else planning FFTs has to go through it as well.
+class PlanWorker {
+private:
+    SDL_mutex* pw_mutex;
+    SDL_cond* pw_cond;
+    SDL_Thread* pw_thread;
+
+    std::deque<std::function<void()>> jobs;
+    size_t submitted = 0;
+    size_t completed = 0;
+    bool should_stop = false;
+
+    static int worker_thread (void* _self) {
+        PlanWorker* self = static_cast<PlanWorker*>(_self);
+        SDL_LockMutex(self->pw_mutex);
+        while (true) {
+            if (self->jobs.empty()) {
+                if (self->should_stop) break;
+                SDL_CondWait(self->pw_cond, self->pw_mutex);
+                continue;
+            }
+
+            std::function<void()> job = std::move(self->jobs.front());
+            self->jobs.pop_front();
+            SDL_UnlockMutex(self->pw_mutex);
+            job();
+            SDL_LockMutex(self->pw_mutex);
+
+            self->completed++;
+            SDL_CondBroadcast(self->pw_cond);
+        }
+        SDL_UnlockMutex(self->pw_mutex);
+        return 0;
+    }
+
+    PlanWorker () : pw_mutex(SDL_CreateMutex()), pw_cond(SDL_CreateCond()) {
+        pw_thread = SDL_CreateThread(&PlanWorker::worker_thread, "plan worker", (void*) this);
+    }
+
+    ~PlanWorker () {
+        SDL_LockMutex(pw_mutex);
+        should_stop = true;
+        SDL_CondBroadcast(pw_cond);
+        SDL_UnlockMutex(pw_mutex);
+        SDL_WaitThread(pw_thread, NULL);
+        SDL_DestroyCond(pw_cond);
+        SDL_DestroyMutex(pw_mutex);
+    }
+
+public:
+    PlanWorker (PlanWorker const&) = delete;
+    PlanWorker& operator= (PlanWorker const&) = delete;
+
+    static PlanWorker& instance () {
+        static PlanWorker worker;
+        return worker;
+    }
+
+    // Queue a job, returns a ticket to wait on
+    size_t submit (std::function<void()> job) {
+        SDL_LockMutex(pw_mutex);
+        jobs.push_back(std::move(job));
+        size_t const ticket = ++submitted;
+        SDL_CondBroadcast(pw_cond);
+        SDL_UnlockMutex(pw_mutex);
+        return ticket;
+    }
+
+    // Wait until the job with the given ticket and all before it have run
+    void wait (size_t ticket) {
+        SDL_LockMutex(pw_mutex);
+        while (completed < ticket) {
+            SDL_CondWait(pw_cond, pw_mutex);
+        }
+        SDL_UnlockMutex(pw_mutex);
+    }
+
+    void run_sync (std::function<void()> job) {
+        wait(submit(std::move(job)));
+    }
+};
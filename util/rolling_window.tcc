@@ -1,4 +1,5 @@
 #include <cstring>
+#include <algorithm>
 
 template <typename SampleT>
 class RollingWindow {
@@ -77,4 +78,11 @@ public:
 	void reset_index () {
 		index = window_length_samples;
 	}
+
+	// Take over the most recent samples of another window, e.g. after a reconfiguration
+	void prefill (RollingWindow const& other) {
+		size_t const len = std::min(window_length_samples, other.window_length_samples);
+		memcpy(data + window_length_samples - len, other.data + other.window_length_samples - len, len * sample_bytes);
+		index = std::min(other.index, window_length_samples);
+	}
 };
\ No newline at end of file
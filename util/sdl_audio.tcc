@@ -14,14 +14,8 @@ namespace audio {
 
     template <typename SampleT>
     void sdl_audio_cb (void* userdata, uint8_t* stream, int len) {
-        RingBuffer<SampleT>* rBuf = (RingBuffer<SampleT>*) userdata;
-        try {
-            SampleT* buf = rBuf->dequeue_clean();
-            std::memcpy(buf, stream, len);
-            rBuf->enqueue_dirty(buf);
-        } catch (const timeout_exception& e) {
-            //
-        }
+        JitterBuffer<SampleT>* jBuf = (JitterBuffer<SampleT>*) userdata;
+        jBuf->write((SampleT const*) stream, len / sizeof(SampleT));
     }
 
     std::vector<std::string> get_audio_device_names () {
@@ -34,13 +28,13 @@ namespace audio {
     }
 
     template <typename SampleT>
-    auto start_audio_stream (RingBuffer<SampleT>* rb, SDL_AudioSpec& spec, int device_id) {
+    auto start_audio_stream (JitterBuffer<SampleT>* jb, SDL_AudioSpec& spec, int device_id) {
         sdl_init();
 
         SDL_AudioDeviceID dev;
         SDL_AudioSpec spec_avail;
         spec.callback = sdl_audio_cb<SampleT>;
-        spec.userdata = rb;
+        spec.userdata = jb;
         dev = SDL_OpenAudioDevice(SDL_GetAudioDeviceName(device_id, 1), 1, &spec, &spec_avail, 0);
 
         if (spec_avail.format != spec.format) {
@@ -0,0 +1,92 @@
+#include <cmath>
+#include <chrono>
+#include <thread>
+#include <random>
+#include <memory>
+#include <atomic>
+#include <limits>
+#include <algorithm>
+#include <functional>
+
+#include <SDL2/SDL.h>
+
+namespace audio {
+
+    // Generates a kick on every beat, offbeat hi-hats and a bass line in real time,
+    // standing in for an audio device on machines without one.
+    template <typename SampleT>
+    class SyntheticSource {
+    private:
+        JitterBuffer<SampleT>* jb;
+        SDL_AudioSpec const spec;
+        double const bpm;
+        SDL_Thread* thread = NULL;
+        std::atomic<bool> should_stop = false;
+        std::minstd_rand rng;
+
+        static int source_thread (void* _self) {
+            SyntheticSource* self = static_cast<SyntheticSource*>(_self);
+            size_t const len = self->spec.samples * self->spec.channels;
+            SampleT* fragment = new SampleT[len];
+            std::uniform_real_distribution<double> noise(-1.0, 1.0);
+
+            double const beat_samples = 60.0 / self->bpm * self->spec.freq;
+            auto const fragment_period = std::chrono::duration<double>(self->spec.samples / (double) self->spec.freq);
+            auto next = std::chrono::steady_clock::now();
+            size_t t = 0;
+
+            while (!self->should_stop) {
+                for (size_t i = 0; i < self->spec.samples; i++, t++) {
+                    double const beat_pos = std::fmod(t, beat_samples) / self->spec.freq;
+                    double const offbeat_pos = std::fmod(t + beat_samples / 2, beat_samples) / self->spec.freq;
+                    double const time_s = t / (double) self->spec.freq;
+
+                    double const kick = std::exp(-beat_pos * 25) * std::sin(2 * M_PI * (50 + 100 * std::exp(-beat_pos * 40)) * beat_pos);
+                    double const hihat = std::exp(-offbeat_pos * 80) * noise(self->rng) * 0.3;
+                    double const bass = 0.2 * std::sin(2 * M_PI * 55 * time_s);
+                    double const value = std::clamp(0.6 * kick + hihat + bass, -1.0, 1.0) * 0.8 * std::numeric_limits<SampleT>::max();
+
+                    for (size_t c = 0; c < self->spec.channels; c++) {
+                        fragment[i * self->spec.channels + c] = (SampleT) value;
+                    }
+                }
+                self->jb->write(fragment, len);
+
+                next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(fragment_period);
+                std::this_thread::sleep_until(next);
+            }
+
+            delete[] fragment;
+            return 0;
+        }
+
+    public:
+        SyntheticSource (JitterBuffer<SampleT>* jb, SDL_AudioSpec const& spec, double bpm, unsigned int seed) :
+            jb(jb), spec(spec), bpm(bpm), rng(seed)
+        {
+            thread = SDL_CreateThread(&SyntheticSource::source_thread, "synthetic source", (void*) this);
+        }
+
+        ~SyntheticSource () {
+            stop();
+        }
+
+        void stop () {
+            if (thread == NULL) return;
+            should_stop = true;
+            SDL_WaitThread(thread, NULL);
+            thread = NULL;
+        }
+    };
+
+    template <typename SampleT>
+    auto start_synthetic_stream (JitterBuffer<SampleT>* jb, SDL_AudioSpec const& spec, double bpm = 124, unsigned int seed = 1) {
+        printf("Synthetic audio source at %.0f BPM with fragment length of %.1f ms\n", bpm, spec.samples * 1000.0 / spec.freq);
+        auto source = std::make_shared<SyntheticSource<SampleT>>(jb, spec, bpm, seed);
+        auto close_synthetic_stream = [source] () {
+            source->stop();
+        };
+        return close_synthetic_stream;
+    }
+
+} // namespace audio
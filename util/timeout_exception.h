@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdexcept>
+
+// Thrown by blocking queues when a wait is given up on, e.g. because the queue is draining
+class timeout_exception : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
@@ -1,5 +1,9 @@
 #include "vis_handler.tcc"
+#include "../util/plan_worker.tcc"
 #include <stdexcept>
+#include <atomic>
+#include <vector>
+#include <functional>
 
 enum BPSW_Phase { Constant, Unchanged, Standing };
 
@@ -9,7 +13,7 @@ struct BPSW_Spec {
 	bool win_window_fn; // Apply window function
 	bool adaptive_crop;
 
-	double* fft_freq_weighing = NULL; // abs(fft(window)) weighing
+	std::function<double (size_t bin, size_t num_bins)> fft_freq_weighing = nullptr; // abs(fft(window)) weighing
 	double fft_dispersion; // arg(fft(window)) freq. dependent weighing
 	BPSW_Phase fft_phase; // Type of phase manipulation for inverse trafo
 	double fft_phase_const; // for fft_phase == BPSW_Phase.Constant constant phase value
@@ -21,27 +25,77 @@ struct BPSW_Spec {
 	float color_inner[4]; // Inner color of the circle
 };
 
-class BandpassStandingWave : public VisualizationHandler {
-private:
+// Everything derived from a BPSW_Spec: FFT plans, rolling window, weighting
+// tables and buffers. Built on the PlanWorker and swapped in between frames.
+struct BPSW_State {
+	BPSW_Spec spec; // Active copy, adaptive_crop changes crop_length_samples
 	RollingWindow<double> rollingWindow;
 	FFTHandler fftHandler;
-	double* result;
-	bool const should_weigh = false;
+	size_t const c_length;
+	std::vector<double> freq_weighing; // Per bin weight
+	std::vector<double> constant_phase; // Per bin phase for BPSW_Phase::Constant
+	double const phase_offset;
+	std::vector<double> abs_vals;
+	std::vector<double> arg_vals;
+	std::vector<double> result; // Sized for the whole window so cropping never reallocates
+
+	BPSW_State (BPSW_Spec const& spec) :
+		spec(spec),
+		rollingWindow(spec.win_length_samples, 0, spec.win_window_fn),
+		fftHandler(spec.win_length_samples),
+		c_length(spec.win_length_samples / 2 + 1),
+		freq_weighing(c_length, 1.0),
+		constant_phase(c_length),
+		phase_offset(2 * M_PI * (spec.fft_phase_const / ((double) spec.win_length_samples))),
+		abs_vals(c_length),
+		arg_vals(c_length),
+		result(spec.win_length_samples)
+	{
+		for (size_t i = 0; i < c_length; i++) {
+			if (spec.fft_freq_weighing) {
+				freq_weighing[i] = spec.fft_freq_weighing(i, c_length);
+			}
+			constant_phase[i] = i * i * spec.fft_dispersion;
+		}
+	}
+};
 
-	SDL_Point* points;
+class BandpassStandingWave : public VisualizationHandler {
+private:
+	BPSW_State* state; // Only touched by the worker thread once running
+	std::atomic<BPSW_State*> staged {nullptr}; // Ready to be swapped in
+	std::atomic<size_t> requested_generation {0};
+
+	void validate (BPSW_Spec const& spec) const {
+		if (audio_spec.samples > spec.win_length_samples) {
+			throw std::invalid_argument("Window cannot be shorter than samples per update");
+		}
+		if (spec.crop_offset + spec.crop_length_samples > spec.win_length_samples) {
+			throw std::invalid_argument("Crop has to lie within the window");
+		}
+	}
 
 	void visualize (VisualizationBuffer const& data) {
 
+		// Swap in a staged reconfiguration, the old state is destroyed off this thread
+		BPSW_State* next = staged.exchange(nullptr);
+		if (next != nullptr) {
+			next->rollingWindow.prefill(state->rollingWindow);
+			BPSW_State* retired = state;
+			state = next;
+			PlanWorker::instance().submit([retired] () { delete retired; });
+		}
+		BPSW_Spec& params = state->spec;
+		FFTHandler& fftHandler = state->fftHandler;
+
 		// Update the rolling window and
-		size_t index_last = rollingWindow.current_index();
-		double* const window_data = rollingWindow.update(data.audio_buffer, audio_spec.samples, data.is_new_beat);
+		size_t index_last = state->rollingWindow.current_index();
+		double* const window_data = state->rollingWindow.update(data.audio_buffer, audio_spec.samples, data.is_new_beat);
 
 		if (data.is_new_beat & params.adaptive_crop) {
 			double beat_period_sec = 60 / data.tempo_estimate;
 			int beat_period_samples = round(audio_spec.freq * beat_period_sec);
-			params.crop_length_samples = std::min(((int) params.win_length_samples), beat_period_samples);
-			delete[] result;
-			result = new double[params.crop_length_samples];
+			params.crop_length_samples = std::min(((int) (params.win_length_samples - params.crop_offset)), beat_period_samples);
 			std::cout << "Setting output size to " << params.crop_length_samples << " samples" << std::endl;
 		}
 
@@ -50,9 +104,9 @@ private:
 	    fftHandler.exec_r2c();
 
 	    // Convert to polar basis
-	    const size_t c_length = params.win_length_samples / 2 + 1;
-	    double* abs_vals = new double[c_length];
-	    double* arg_vals = new double[c_length];
+	    const size_t c_length = state->c_length;
+	    double* const abs_vals = state->abs_vals.data();
+	    double* const arg_vals = state->arg_vals.data();
 	    for (size_t i = 0; i < c_length; i++) {
 	        std::complex<double> c(fftHandler.complex[i][0], fftHandler.complex[i][1]);
 	        abs_vals[i] = std::abs(c);
@@ -60,10 +114,9 @@ private:
 	    }
 
 	    // Transform polar frequency spectrum
+	    double const bin_phase = 2 * M_PI * (index_last / ((double) params.win_length_samples));
 	    for (size_t i = 0; i < c_length; i++) {
-	        double abs_weighted = abs_vals[i] * params.fft_freq_weighing[i];
-	        double bin_phase = 2 * M_PI * (index_last / ((double) params.win_length_samples));
-	        double phase_offset = 2 * M_PI * (params.fft_phase_const / ((double) params.win_length_samples));
+	        double abs_weighted = abs_vals[i] * state->freq_weighing[i];
 
 	        double arg_shifted = 0;
 	        switch (params.fft_phase) {
@@ -71,10 +124,10 @@ private:
 	        		arg_shifted = arg_vals[i] + params.fft_dispersion * bin_phase;
 	        		break;
 	        	case BPSW_Phase::Constant:
-	        		arg_shifted = i * i * params.fft_dispersion;
+	        		arg_shifted = state->constant_phase[i];
 	        		break;
 	        	case BPSW_Phase::Standing:
-	        		arg_shifted = arg_vals[i] - (i + params.fft_dispersion) * (bin_phase + phase_offset);
+	        		arg_shifted = arg_vals[i] - (i + params.fft_dispersion) * (bin_phase + state->phase_offset);
 	        		break;
 	        }
 	        std::complex<double> c = std::polar(abs_weighted, arg_shifted);
@@ -82,50 +135,61 @@ private:
 	        fftHandler.complex[i][0] = std::real(c);
 	        fftHandler.complex[i][1] = std::imag(c);
 	    }
-	    delete[] abs_vals;
-	    delete[] arg_vals;
 
 	    // Execute inverse fourier transformation
 	    fftHandler.exec_c2r();
 
 	    for (size_t i = 0; i < params.crop_length_samples; i++) {
 	    	// Scaling is not preserved: irfft(rfft(x))[i] = x[i] * len(x)
-	    	result[i] = fftHandler.real[params.crop_offset + i] / params.win_length_samples;
+	    	state->result[i] = fftHandler.real[params.crop_offset + i] / params.win_length_samples;
 	    }
 	}
 
 	void get_result (float* output) {
-		for (size_t i = 0; i < params.crop_length_samples; i++) {
-			output[i] = result[i];
+		for (size_t i = 0; i < state->spec.crop_length_samples; i++) {
+			output[i] = state->result[i];
 		}
 	}
 
 	unsigned int get_result_size() {
-		return params.crop_length_samples;
+		return state->spec.crop_length_samples;
 	}
 
 public:
 	BPSW_Spec& params;
-	std::deque<std::vector<float>> data_lookback_beats;
 
 	BandpassStandingWave (SDL_AudioSpec const& audio_spec, BPSW_Spec& params) :
 		VisualizationHandler(audio_spec),
-		rollingWindow(params.win_length_samples, 0, params.win_window_fn),
-		fftHandler(params.win_length_samples),
-		should_weigh(params.fft_freq_weighing != NULL),
 		params(params)
 	{
-		result = new double[params.crop_length_samples];
-		std::cout << "Initializer list finised\n";
-		// assert(params.win_length_samples >= (params.crop_length_samples + params.crop_offset),
+		validate(params);
 		std::cout << "Initilizing BPSW with win_length_samples=" << params.win_length_samples << " and crop_length_samples=" << params.crop_length_samples << std::endl;
-
-		if (audio_spec.samples > params.win_length_samples) {
-			throw std::invalid_argument("Window cannot be shorter than samples per update");
-		}
+		PlanWorker::instance().run_sync([this] () {
+			state = new BPSW_State(this->params);
+		});
 	}
 
 	~BandpassStandingWave () {
-		delete[] result;
+		// Outstanding reconfigurations refer to this handler, let them finish first
+		BPSW_State* const current = state;
+		PlanWorker::instance().run_sync([this, current] () {
+			delete current;
+			delete staged.exchange(nullptr);
+		});
+	}
+
+	// Stage a new configuration without blocking. The FFT plans, rolling window and
+	// tables are built on the PlanWorker and swapped in before the next frame.
+	// Requests superseded before they were built are skipped.
+	void reconfigure (BPSW_Spec const& spec) {
+		validate(spec);
+		size_t const generation = ++requested_generation;
+		PlanWorker::instance().submit([this, spec, generation] () {
+			if (generation != requested_generation) {
+				return;
+			}
+			BPSW_State* const next = new BPSW_State(spec);
+			delete staged.exchange(next); // Drop a state that was never picked up
+		});
 	}
 };
@@ -0,0 +1,326 @@
+#pragma once
+
+#include "vis_handler.tcc"
+#include "vis_trace.tcc"
+#include "../util/plan_worker.tcc"
+
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <vector>
+#include <string>
+#include <functional>
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_thread.h>
+
+// Latest results of a stream, all handler results are concatenated in handler order
+struct StreamFrame {
+	size_t frame_id = 0;
+	size_t beat_id = 0; // Incremented on every beat, so readers skipping frames don't miss one
+	double tempo_estimate = 0;
+	bool is_new_beat = false;
+	std::vector<float> results;
+	std::vector<size_t> result_sizes;
+	std::vector<std::deque<std::vector<float>>> lookback_beats; // Per handler, results of the last beats
+};
+
+struct StreamStats {
+	size_t frames;
+	double cpu_us; // Pipeline thread and its handlers
+	double wall_us;
+	double tempo_estimate;
+	JitterStats jitter;
+};
+
+// One capture stream: an audio source, its jitter buffer, beat tracker and handler group.
+// Each pipeline runs on its own thread (its handlers on theirs) and publishes its
+// latest frame for the renderer to pick up.
+template <typename SampleT>
+class StreamPipeline {
+private:
+	static constexpr size_t max_lookback_beats = 4;
+
+	SDL_mutex* sp_mutex;
+	SDL_cond* sp_cond;
+	SDL_Thread* sp_thread = NULL;
+
+	JitterBuffer<SampleT> jitterBuffer;
+	BTrack* btrack; // Plans FFTs, so it is built and destroyed on the PlanWorker
+	math::ExpFilter<double> max_filter;
+	double* mono;
+
+	std::vector<VisualizationHandler*> handlers;
+	std::function<void()> stop_source = [] () {};
+	trace::TraceReader const* replay = nullptr;
+	bool replay_throttled = true;
+	trace::TraceWriter* recorder = nullptr;
+
+	StreamFrame front; // Published, guarded by sp_mutex
+	StreamFrame back; // Owned by the pipeline thread
+	bool should_stop = false;
+	bool finished = false;
+	bool handlers_stopped = false;
+
+	size_t frames = 0;
+	double cpu_us = 0;
+	std::chrono::steady_clock::time_point started;
+
+	// Fill `mono` with the next fragment, false once the source is exhausted or drained
+	bool next_buffer (size_t frame_idx, double& tempo_estimate, bool& is_new_beat) {
+		if (replay != nullptr) {
+			if (frame_idx >= replay->num_frames()) {
+				return false;
+			}
+			if (replay_throttled) {
+				trace::wait_for_timestamp(started, replay->frame_header(frame_idx).timestamp_us);
+			}
+			VisualizationBuffer const frame = replay->frame(frame_idx);
+			memcpy(mono, frame.audio_buffer, audio_spec.samples * sizeof(double));
+			tempo_estimate = frame.tempo_estimate;
+			is_new_beat = frame.is_new_beat;
+			return true;
+		}
+
+		try {
+			SampleT* const buf = jitterBuffer.dequeue_dirty();
+			for (size_t i = 0; i < audio_spec.samples; i++) {
+				mono[i] = buf[audio_spec.channels * i] / ((double) std::pow(2, 16));
+			}
+			memset(buf, audio_spec.silence, jitterBuffer.buffer_len * sizeof(SampleT));
+			jitterBuffer.enqueue_clean(buf);
+		} catch (const timeout_exception& e) {
+			return false;
+		}
+
+		// Maximum filter
+		double maxval = math::max_value(mono, audio_spec.samples);
+		maxval = *max_filter.update(&maxval);
+		maxval = maxval > 2 ? 2 : (maxval < 0.01 ? 0.02 : maxval);
+		for (size_t i = 0; i < audio_spec.samples; i++) {
+			mono[i] /= 2.5 * maxval;
+		}
+
+		btrack->processAudioFrame(mono);
+		is_new_beat = btrack->beatDueInCurrentFrame();
+		tempo_estimate = btrack->getCurrentTempoEstimate();
+		return true;
+	}
+
+	static int pipeline_thread (void* _self) {
+		StreamPipeline* self = static_cast<StreamPipeline*>(_self);
+		size_t frame_idx = 0;
+
+		while (true) {
+			SDL_LockMutex(self->sp_mutex);
+			bool const stop = self->should_stop;
+			SDL_UnlockMutex(self->sp_mutex);
+			if (stop) break;
+
+			double const cpu_start = thread_cpu_time_us();
+			double tempo_estimate;
+			bool is_new_beat;
+			if (!self->next_buffer(frame_idx++, tempo_estimate, is_new_beat)) {
+				break;
+			}
+
+			VisualizationBuffer const data {
+				.audio_buffer = self->mono,
+				.tempo_estimate = tempo_estimate,
+				.is_new_beat = is_new_beat
+			};
+
+			if (self->recorder != nullptr) {
+				self->recorder->record(data, self->audio_spec.samples);
+			}
+
+			for (VisualizationHandler* handler : self->handlers) {
+				handler->process_ring_buffer(data);
+			}
+
+			StreamFrame& back = self->back;
+			back.results.clear();
+			back.result_sizes.clear();
+			for (VisualizationHandler* handler : self->handlers) {
+				handler->await_buffer_processed(false); // Keep lock from here
+				size_t const offset = back.results.size();
+				size_t const result_size = handler->get_result_size();
+				back.results.resize(offset + result_size);
+				back.result_sizes.push_back(result_size);
+				handler->unlock_mutex();
+				handler->await_result(back.results.data() + offset);
+			}
+			back.tempo_estimate = tempo_estimate;
+			back.is_new_beat = is_new_beat;
+
+			SDL_LockMutex(self->sp_mutex);
+			std::swap(self->front.results, back.results);
+			std::swap(self->front.result_sizes, back.result_sizes);
+			self->front.tempo_estimate = back.tempo_estimate;
+			self->front.is_new_beat = back.is_new_beat;
+			self->front.frame_id++;
+			if (is_new_beat) {
+				self->front.beat_id++;
+				size_t offset = 0;
+				for (size_t i = 0; i < self->handlers.size(); i++) {
+					size_t const size = self->front.result_sizes[i];
+					auto& queue = self->front.lookback_beats[i];
+					queue.emplace_back(self->front.results.begin() + offset, self->front.results.begin() + offset + size);
+					if (queue.size() > max_lookback_beats) {
+						queue.pop_front();
+					}
+					offset += size;
+				}
+			}
+			self->frames++;
+			self->cpu_us += thread_cpu_time_us() - cpu_start;
+			SDL_CondBroadcast(self->sp_cond);
+			SDL_UnlockMutex(self->sp_mutex);
+		}
+
+		SDL_LockMutex(self->sp_mutex);
+		self->finished = true;
+		SDL_CondBroadcast(self->sp_cond);
+		SDL_UnlockMutex(self->sp_mutex);
+		return 0;
+	}
+
+public:
+	SDL_AudioSpec audio_spec; // Handlers keep a reference, the pipeline must not move
+	std::string const name;
+
+	StreamPipeline (std::string const& name, SDL_AudioSpec const& spec, size_t min_buffers_delay, size_t max_buffers_delay) :
+		sp_mutex(SDL_CreateMutex()), sp_cond(SDL_CreateCond()),
+		jitterBuffer(spec.channels * spec.samples, spec.channels, spec.samples / (double) spec.freq * 1000000.0,
+			min_buffers_delay, max_buffers_delay),
+		max_filter(1, 0.90, 0.04, 1),
+		audio_spec(spec), name(name)
+	{
+		mono = new double[spec.samples];
+		PlanWorker::instance().run_sync([this, &spec] () {
+			btrack = new BTrack(spec.freq, spec.samples / 2, spec.samples);
+		});
+	}
+
+	StreamPipeline (StreamPipeline const&) = delete;
+	StreamPipeline& operator= (StreamPipeline const&) = delete;
+
+	~StreamPipeline () {
+		stop();
+		for (VisualizationHandler* handler : handlers) {
+			delete handler;
+		}
+		delete[] mono;
+		BTrack* const retired = btrack;
+		PlanWorker::instance().run_sync([retired] () {
+			delete retired;
+		});
+		SDL_DestroyCond(sp_cond);
+		SDL_DestroyMutex(sp_mutex);
+	}
+
+	// Takes ownership, handlers have to be constructed with this pipeline's audio_spec
+	void add_handler (VisualizationHandler* handler) {
+		handlers.push_back(handler);
+		front.lookback_beats.emplace_back();
+	}
+
+	std::vector<VisualizationHandler*> const& get_handlers () const {
+		return handlers;
+	}
+
+	void set_recorder (trace::TraceWriter* writer) {
+		recorder = writer;
+	}
+
+	void start_device (int device_id) {
+		auto device_names = audio::get_audio_device_names();
+		std::cout << "Starting audio stream \"" << name << "\" on \"" << device_names[device_id] << "\"" << std::endl;
+		stop_source = audio::start_audio_stream(&jitterBuffer, audio_spec, device_id);
+		run();
+	}
+
+	void start_synthetic (double bpm, unsigned int seed) {
+		std::cout << "Starting synthetic stream \"" << name << "\"" << std::endl;
+		stop_source = audio::start_synthetic_stream(&jitterBuffer, audio_spec, bpm, seed);
+		run();
+	}
+
+	// Feed the handlers from a trace instead of an audio source
+	void start_replay (trace::TraceReader const* reader, bool throttled) {
+		reader->require_frame_length(audio_spec.samples);
+		std::cout << "Replaying " << reader->num_frames() << " frames from trace on stream \"" << name << "\"" << std::endl;
+		replay = reader;
+		replay_throttled = throttled;
+		run();
+	}
+
+	void run () {
+		started = std::chrono::steady_clock::now();
+		sp_thread = SDL_CreateThread(&StreamPipeline::pipeline_thread, "stream pipeline", (void*) this);
+	}
+
+	void stop () {
+		SDL_LockMutex(sp_mutex);
+		should_stop = true;
+		SDL_UnlockMutex(sp_mutex);
+		jitterBuffer.drain();
+
+		if (sp_thread != NULL) {
+			SDL_WaitThread(sp_thread, NULL);
+			sp_thread = NULL;
+		}
+		if (!handlers_stopped) {
+			for (VisualizationHandler* handler : handlers) {
+				handler->stop_thread();
+			}
+			handlers_stopped = true;
+		}
+		stop_source();
+		stop_source = [] () {};
+	}
+
+	// Wait for a frame newer than `last_frame_id`. Returns false once the stream has ended.
+	bool await_frame (size_t last_frame_id) {
+		SDL_LockMutex(sp_mutex);
+		while (front.frame_id <= last_frame_id && !finished) {
+			SDL_CondWait(sp_cond, sp_mutex);
+		}
+		bool const has_frame = front.frame_id > last_frame_id;
+		SDL_UnlockMutex(sp_mutex);
+		return has_frame;
+	}
+
+	// True once the source is exhausted and its last frame has been published
+	bool has_ended () {
+		SDL_LockMutex(sp_mutex);
+		bool const ended = finished;
+		SDL_UnlockMutex(sp_mutex);
+		return ended;
+	}
+
+	// Access the latest published frame without copying it
+	void with_latest (std::function<void(StreamFrame const&)> const& fn) {
+		SDL_LockMutex(sp_mutex);
+		fn(front);
+		SDL_UnlockMutex(sp_mutex);
+	}
+
+	StreamStats stats () {
+		double handlers_cpu_us = 0;
+		for (VisualizationHandler* handler : handlers) {
+			handlers_cpu_us += handler->cpu_time_us();
+		}
+		SDL_LockMutex(sp_mutex);
+		std::chrono::duration<double, std::micro> const wall = std::chrono::steady_clock::now() - started;
+		StreamStats const s {
+			.frames = frames,
+			.cpu_us = cpu_us + handlers_cpu_us,
+			.wall_us = wall.count(),
+			.tempo_estimate = front.tempo_estimate,
+			.jitter = jitterBuffer.stats()
+		};
+		SDL_UnlockMutex(sp_mutex);
+		return s;
+	}
+};
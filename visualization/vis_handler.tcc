@@ -1,8 +1,12 @@
+#pragma once
+
 #include <functional>
 
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_thread.h>
 
+#include "../util/cpu_time.tcc"
+
 struct VisualizationBuffer {
 	double const* audio_buffer;
 	double tempo_estimate;
@@ -20,6 +24,7 @@ private:
     bool running = false;
     bool buffer_processed = true;
     VisualizationBuffer buffer;
+    double visualize_cpu_us = 0;
 
     static int worker_thread (void * _self) {
     	VisualizationHandler* self = static_cast<VisualizationHandler*>(_self);
@@ -34,13 +39,18 @@ private:
 				break;
 			}
 
-			SDL_CondWait(self->vh_cond, self->vh_mutex);
-			if (self->buffer_processed == true || self->should_stop) {
+			// Only wait while there is nothing to do, a buffer may have arrived before we got here
+			while (self->buffer_processed && !self->should_stop) {
+				SDL_CondWait(self->vh_cond, self->vh_mutex);
+			}
+			if (self->should_stop) {
 				SDL_UnlockMutex(self->vh_mutex);
 				continue;
 			}
 
+			double const cpu_start = thread_cpu_time_us();
 			self->visualize(self->buffer);
+			self->visualize_cpu_us += thread_cpu_time_us() - cpu_start;
 			self->buffer_processed = true;
 
 	        SDL_CondSignal(self->vh_cond);
@@ -100,12 +110,20 @@ public:
 		SDL_UnlockMutex(vh_mutex);
 	}
 
+	// Accumulated CPU time of the worker thread spent in visualize
+	double cpu_time_us () {
+		SDL_LockMutex(vh_mutex);
+		double const val = visualize_cpu_us;
+		SDL_UnlockMutex(vh_mutex);
+		return val;
+	}
+
 	VisualizationHandler (SDL_AudioSpec const& audio_spec) :
 		vh_mutex(SDL_CreateMutex()), vh_cond(SDL_CreateCond()), audio_spec(audio_spec) {
 		vh_thread = SDL_CreateThread(&VisualizationHandler::worker_thread, "visualization worker", (void *) this);
 	}
 
-    ~VisualizationHandler () {
+    virtual ~VisualizationHandler () {
 		SDL_LockMutex(vh_mutex);
 		if (running) {
 			SDL_UnlockMutex(vh_mutex);
@@ -0,0 +1,446 @@
+#pragma once
+
+#include "vis_handler.tcc"
+
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <cstddef>
+#include <cstring>
+#include <cmath>
+#include <deque>
+#include <vector>
+#include <string>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace trace {
+
+	typedef std::chrono::steady_clock trace_clk;
+
+	// File layout: one FileHeader followed by frames, each a FrameHeader and
+	// `num_samples` doubles. The file is only ever appended to and everything is
+	// 8-byte aligned, so a reader can mmap it and hand out the samples in place.
+	constexpr char file_magic[8] = {'S', 'L', 'O', 'T', 'H', 'T', 'R', 'C'};
+	constexpr uint32_t file_version = 2;
+
+	struct FileHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t sample_rate;
+		uint32_t update_length_samples;
+		uint32_t frames_recorded; // Frame indices handed out, patched in on close. 0 if never closed
+	};
+
+	struct FrameHeader {
+		uint64_t frame_index; // Counts every recorded frame, dropped ones leave a gap
+		uint64_t timestamp_us; // Time since the start of the recording
+		double tempo_estimate;
+		uint32_t num_samples;
+		uint32_t is_new_beat;
+	};
+
+	static_assert(sizeof(FileHeader) % sizeof(double) == 0, "FileHeader breaks sample alignment");
+	static_assert(sizeof(FrameHeader) % sizeof(double) == 0, "FrameHeader breaks sample alignment");
+
+	// Appends VisualizationBuffers to a trace file. `record` only copies into a
+	// preallocated slot, the file I/O happens on a separate writer thread.
+	// If the writer falls behind, frames are dropped unless the writer is
+	// `lossless`, in which case `record` waits for a free slot. Dropped frames
+	// still use up a frame index, so readers can tell where the gaps are.
+	class TraceWriter {
+	private:
+		struct PendingFrame {
+			FrameHeader header;
+			double* samples;
+		};
+
+		FILE* file;
+		SDL_mutex* tw_mutex;
+		SDL_cond* tw_cond;
+		SDL_Thread* tw_thread = NULL;
+
+		size_t const slot_length;
+		bool const lossless;
+		std::vector<double*> slots;
+		std::vector<double*> free_slots;
+		std::deque<PendingFrame> pending;
+		bool should_stop = false;
+
+		trace_clk::time_point const start;
+		uint64_t next_frame_index = 0;
+		size_t frames_written = 0;
+		size_t frames_dropped = 0;
+
+		static int writer_thread (void* _self) {
+			TraceWriter* self = static_cast<TraceWriter*>(_self);
+			SDL_LockMutex(self->tw_mutex);
+			while (true) {
+				if (self->pending.empty()) {
+					if (self->should_stop) {
+						break;
+					}
+					SDL_CondWait(self->tw_cond, self->tw_mutex);
+					continue;
+				}
+
+				PendingFrame frame = self->pending.front();
+				self->pending.pop_front();
+
+				// Release the lock while writing so the hot path is never held up by I/O
+				SDL_UnlockMutex(self->tw_mutex);
+				fwrite(&frame.header, sizeof(FrameHeader), 1, self->file);
+				fwrite(frame.samples, sizeof(double), frame.header.num_samples, self->file);
+				SDL_LockMutex(self->tw_mutex);
+
+				self->free_slots.push_back(frame.samples);
+				self->frames_written++;
+				SDL_CondBroadcast(self->tw_cond);
+			}
+			SDL_UnlockMutex(self->tw_mutex);
+			fflush(self->file);
+			return 0;
+		}
+
+	public:
+		TraceWriter (std::string const& path, SDL_AudioSpec const& audio_spec, size_t slot_length,
+			bool lossless = false, size_t num_slots = 64) :
+			tw_mutex(SDL_CreateMutex()), tw_cond(SDL_CreateCond()),
+			slot_length(slot_length), lossless(lossless), start(trace_clk::now())
+		{
+			file = fopen(path.c_str(), "wb");
+			if (file == NULL) {
+				throw std::runtime_error("Could not open trace file \"" + path + "\" for writing");
+			}
+
+			FileHeader header {};
+			memcpy(header.magic, file_magic, sizeof(file_magic));
+			header.version = file_version;
+			header.sample_rate = audio_spec.freq;
+			header.update_length_samples = audio_spec.samples;
+			fwrite(&header, sizeof(FileHeader), 1, file);
+
+			for (size_t i = 0; i < num_slots; i++) {
+				slots.push_back(new double[slot_length]);
+			}
+			free_slots = slots;
+
+			tw_thread = SDL_CreateThread(&TraceWriter::writer_thread, "trace writer", (void*) this);
+		}
+
+		~TraceWriter () {
+			close();
+			for (double* slot : slots) {
+				delete[] slot;
+			}
+			SDL_DestroyCond(tw_cond);
+			SDL_DestroyMutex(tw_mutex);
+		}
+
+		// Record a frame, timestamped relative to the construction of the writer
+		void record (VisualizationBuffer const& data, size_t num_samples) {
+			std::chrono::duration<double, std::micro> const since_start = trace_clk::now() - start;
+			record(data, num_samples, (uint64_t) since_start.count());
+		}
+
+		void record (VisualizationBuffer const& data, size_t num_samples, uint64_t timestamp_us) {
+			if (num_samples > slot_length) {
+				throw std::invalid_argument("Trace frame is longer than the writer's slot length");
+			}
+
+			SDL_LockMutex(tw_mutex);
+			while (free_slots.empty() && lossless && !should_stop) {
+				SDL_CondWait(tw_cond, tw_mutex);
+			}
+			uint64_t const frame_index = next_frame_index++;
+			if (free_slots.empty() || should_stop) {
+				frames_dropped++;
+				SDL_UnlockMutex(tw_mutex);
+				return;
+			}
+			double* slot = free_slots.back();
+			free_slots.pop_back();
+			SDL_UnlockMutex(tw_mutex);
+
+			memcpy(slot, data.audio_buffer, num_samples * sizeof(double));
+			FrameHeader const header {
+				.frame_index = frame_index,
+				.timestamp_us = timestamp_us,
+				.tempo_estimate = data.tempo_estimate,
+				.num_samples = (uint32_t) num_samples,
+				.is_new_beat = data.is_new_beat
+			};
+
+			SDL_LockMutex(tw_mutex);
+			pending.push_back(PendingFrame{header, slot});
+			SDL_CondBroadcast(tw_cond);
+			SDL_UnlockMutex(tw_mutex);
+		}
+
+		// Flush all pending frames and close the file
+		void close () {
+			if (tw_thread == NULL) return;
+
+			SDL_LockMutex(tw_mutex);
+			should_stop = true;
+			SDL_CondBroadcast(tw_cond);
+			SDL_UnlockMutex(tw_mutex);
+
+			SDL_WaitThread(tw_thread, NULL);
+			tw_thread = NULL;
+
+			// Frames dropped after the last written one leave no gap, the total count tells
+			SDL_LockMutex(tw_mutex);
+			uint32_t const frames_recorded = next_frame_index;
+			SDL_UnlockMutex(tw_mutex);
+			fseek(file, offsetof(FileHeader, frames_recorded), SEEK_SET);
+			fwrite(&frames_recorded, sizeof(frames_recorded), 1, file);
+			fclose(file);
+
+			printf("Trace writer closed: %zu frames written, %zu dropped\n", frames_written, frames_dropped);
+		}
+
+		size_t dropped () {
+			SDL_LockMutex(tw_mutex);
+			size_t const val = frames_dropped;
+			SDL_UnlockMutex(tw_mutex);
+			return val;
+		}
+	};
+
+	// Read-only view of a trace file. The file is mapped into memory, frames
+	// are indexed once on construction and returned without copying.
+	class TraceReader {
+	private:
+		int fd = -1;
+		void* mapping = MAP_FAILED;
+		size_t mapping_length = 0;
+		FileHeader const* header;
+		std::vector<FrameHeader const*> frames;
+		size_t frames_missing = 0;
+
+	public:
+		TraceReader (std::string const& path) {
+			fd = open(path.c_str(), O_RDONLY);
+			if (fd < 0) {
+				throw std::runtime_error("Could not open trace file \"" + path + "\"");
+			}
+
+			struct stat st;
+			fstat(fd, &st);
+			mapping_length = st.st_size;
+			if (mapping_length < sizeof(FileHeader)) {
+				::close(fd);
+				throw std::runtime_error("Trace file \"" + path + "\" is too short");
+			}
+
+			mapping = mmap(NULL, mapping_length, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (mapping == MAP_FAILED) {
+				::close(fd);
+				throw std::runtime_error("Could not map trace file \"" + path + "\"");
+			}
+
+			header = (FileHeader const*) mapping;
+			if (memcmp(header->magic, file_magic, sizeof(file_magic)) != 0 || header->version != file_version) {
+				munmap(mapping, mapping_length);
+				::close(fd);
+				throw std::runtime_error("\"" + path + "\" is not a sloth3 trace file");
+			}
+
+			char const* const base = (char const*) mapping;
+			size_t offset = sizeof(FileHeader);
+			while (offset + sizeof(FrameHeader) <= mapping_length) {
+				FrameHeader const* frame = (FrameHeader const*) (base + offset);
+				size_t const frame_length = sizeof(FrameHeader) + frame->num_samples * sizeof(double);
+				if (offset + frame_length > mapping_length) {
+					break;
+				}
+				uint64_t const expected_index = frames.empty() ? 0 : frames.back()->frame_index + 1;
+				if (frame->frame_index < expected_index) {
+					munmap(mapping, mapping_length);
+					::close(fd);
+					throw std::runtime_error("Trace \"" + path + "\" has frames out of order");
+				}
+				frames_missing += frame->frame_index - expected_index;
+				frames.push_back(frame);
+				offset += frame_length;
+			}
+			if (offset != mapping_length) {
+				printf("Ignoring truncated frame at the end of trace \"%s\"\n", path.c_str());
+			}
+			uint64_t const indices_seen = frames.empty() ? 0 : frames.back()->frame_index + 1;
+			if (header->frames_recorded > indices_seen) {
+				frames_missing += header->frames_recorded - indices_seen;
+			} else if (header->frames_recorded == 0 && !frames.empty()) {
+				printf("Trace \"%s\" was not closed, frames dropped at its end can't be accounted for\n", path.c_str());
+			}
+			if (frames_missing > 0) {
+				printf("Trace \"%s\" is missing %zu frames the writer dropped, a replay differs from the recording\n",
+					path.c_str(), frames_missing);
+			}
+		}
+
+		~TraceReader () {
+			munmap(mapping, mapping_length);
+			::close(fd);
+		}
+
+		TraceReader (TraceReader const&) = delete;
+		TraceReader& operator= (TraceReader const&) = delete;
+
+		size_t num_frames () const {
+			return frames.size();
+		}
+
+		uint32_t sample_rate () const {
+			return header->sample_rate;
+		}
+
+		uint32_t update_length_samples () const {
+			return header->update_length_samples;
+		}
+
+		// Frames dropped while recording, visible as gaps in the frame indices
+		size_t missing_frames () const {
+			return frames_missing;
+		}
+
+		// Handlers read a fixed number of samples per frame, shorter frames would be read past their end
+		void require_frame_length (size_t num_samples) const {
+			for (size_t i = 0; i < frames.size(); i++) {
+				if (frames[i]->num_samples < num_samples) {
+					throw std::runtime_error("Trace frame " + std::to_string(i) + " has " + std::to_string(frames[i]->num_samples)
+						+ " samples, " + std::to_string(num_samples) + " are needed per frame");
+				}
+			}
+		}
+
+		FrameHeader const& frame_header (size_t i) const {
+			return *frames[i];
+		}
+
+		// The returned buffer points into the mapping and stays valid as long as the reader
+		VisualizationBuffer frame (size_t i) const {
+			return VisualizationBuffer {
+				.audio_buffer = (double const*) (frames[i] + 1),
+				.tempo_estimate = frames[i]->tempo_estimate,
+				.is_new_beat = frames[i]->is_new_beat != 0
+			};
+		}
+	};
+
+	// Sleep until the given trace timestamp is due, measured from `start`.
+	// The last millisecond is spun to keep the original pacing tight.
+	void wait_for_timestamp (trace_clk::time_point const& start, uint64_t timestamp_us) {
+		auto const due = start + std::chrono::microseconds(timestamp_us);
+		auto const coarse = due - std::chrono::milliseconds(1);
+		if (trace_clk::now() < coarse) {
+			std::this_thread::sleep_until(coarse);
+		}
+		while (trace_clk::now() < due);
+	}
+
+	struct ReplayStats {
+		size_t frames;
+		double wall_us;
+		double frame_us_avg;
+		double frame_us_max;
+	};
+
+	// Feed a recording into a set of handlers, headless. With `throttled` the
+	// original pace is kept, otherwise frames are pushed as fast as the handlers
+	// process them. The concatenated handler results of every frame can be
+	// written to `results`, which makes for a golden trace to diff against.
+	ReplayStats replay (TraceReader const& reader, VisualizationHandler* const* handlers, size_t const num_handlers,
+		bool throttled, TraceWriter* results = nullptr) {
+
+		ReplayStats stats {0, 0, 0, 0};
+		std::vector<float> results_concat;
+		std::vector<double> results_double;
+
+		auto const start = trace_clk::now();
+		for (size_t f = 0; f < reader.num_frames(); f++) {
+			FrameHeader const& header = reader.frame_header(f);
+			if (throttled) {
+				wait_for_timestamp(start, header.timestamp_us);
+			}
+
+			auto const frame_start = trace_clk::now();
+			VisualizationBuffer const data = reader.frame(f);
+			for (size_t i = 0; i < num_handlers; i++) {
+				handlers[i]->process_ring_buffer(data);
+			}
+
+			size_t total_length = 0;
+			for (size_t i = 0; i < num_handlers; i++) {
+				handlers[i]->await_buffer_processed(false);
+				size_t const offset = total_length;
+				total_length += handlers[i]->get_result_size();
+				results_concat.resize(total_length);
+				handlers[i]->unlock_mutex();
+				handlers[i]->await_result(results_concat.data() + offset);
+			}
+
+			std::chrono::duration<double, std::micro> const frame_us = trace_clk::now() - frame_start;
+			stats.frame_us_avg += frame_us.count();
+			stats.frame_us_max = std::max(stats.frame_us_max, frame_us.count());
+			stats.frames++;
+
+			if (results != nullptr) {
+				results_double.assign(results_concat.begin(), results_concat.begin() + total_length);
+				VisualizationBuffer const result_frame {
+					.audio_buffer = results_double.data(),
+					.tempo_estimate = data.tempo_estimate,
+					.is_new_beat = data.is_new_beat
+				};
+				results->record(result_frame, total_length, header.timestamp_us);
+			}
+		}
+
+		std::chrono::duration<double, std::micro> const wall = trace_clk::now() - start;
+		stats.wall_us = wall.count();
+		stats.frame_us_avg = stats.frames > 0 ? stats.frame_us_avg / stats.frames : 0;
+		return stats;
+	}
+
+	struct CompareStats {
+		size_t frames_compared;
+		size_t frames_differing;
+		double max_abs_diff;
+	};
+
+	// Compare two traces sample by sample. Frames with different lengths or
+	// beat flags count as differing, as do any surplus frames in either trace.
+	CompareStats compare (TraceReader const& a, TraceReader const& b, double tolerance = 1e-9) {
+		CompareStats stats {0, 0, 0};
+		size_t const num_frames = std::min(a.num_frames(), b.num_frames());
+		for (size_t f = 0; f < num_frames; f++) {
+			FrameHeader const& header_a = a.frame_header(f);
+			FrameHeader const& header_b = b.frame_header(f);
+			stats.frames_compared++;
+
+			if (header_a.num_samples != header_b.num_samples || header_a.is_new_beat != header_b.is_new_beat) {
+				stats.frames_differing++;
+				continue;
+			}
+
+			double const* samples_a = a.frame(f).audio_buffer;
+			double const* samples_b = b.frame(f).audio_buffer;
+			double frame_max_diff = 0;
+			for (size_t i = 0; i < header_a.num_samples; i++) {
+				frame_max_diff = std::max(frame_max_diff, std::abs(samples_a[i] - samples_b[i]));
+			}
+			stats.max_abs_diff = std::max(stats.max_abs_diff, frame_max_diff);
+			if (frame_max_diff > tolerance) {
+				stats.frames_differing++;
+			}
+		}
+		stats.frames_differing += std::max(a.num_frames(), b.num_frames()) - num_frames;
+		return stats;
+	}
+
+} // namespace trace